@@ -0,0 +1,100 @@
+# Generates NativeBindings.h from NativeBindings.list.
+#
+# Invoked at build time as:
+#
+#   cmake -DINPUT=NativeBindings.list -DOUTPUT=NativeBindings.h -P GenerateNativeBindings.cmake
+#
+# The output is included by rooture.cxx and relies on the lval helpers
+# defined there.
+
+# Skip blank lines and comments
+file(STRINGS ${INPUT} lines REGEX "^[ \t]*[A-Za-z_]")
+
+set(includes "")
+set(functions "")
+set(table "")
+set(index 0)
+
+foreach(line ${lines})
+  string(STRIP "${line}" line)
+  string(REGEX REPLACE "[ \t]+" ";" fields "${line}")
+  list(LENGTH fields nfields)
+  if(nfields LESS 3)
+    message(FATAL_ERROR "Malformed binding: ${line}")
+  endif()
+  list(GET fields 0 klass)
+  list(GET fields 1 method)
+  list(GET fields 2 rtype)
+  math(EXPR nargs "${nfields} - 3")
+
+  list(FIND includes ${klass} found)
+  if(found EQUAL -1)
+    list(APPEND includes ${klass})
+  endif()
+
+  # Argument checks and conversions
+  set(checks "")
+  set(params "")
+  set(signature "")
+  set(i 0)
+  while(i LESS nargs)
+    math(EXPR field "${i} + 3")
+    list(GET fields ${field} atype)
+    if(atype STREQUAL "string")
+      set(checks "${checks}  LASSERT_TYPE(\"${method}\", a, ${i}, LVAL_STR);\n")
+      set(param "a->cell[${i}]->str")
+    elseif(atype STREQUAL "double" OR atype STREQUAL "float")
+      set(checks "${checks}  LASSERT_NUMERIC(\"${method}\", a, ${i});\n")
+      set(param "lval_to_double(a->cell[${i}])")
+    elseif(atype MATCHES "^(bool|int|long|Long64_t)$")
+      set(checks "${checks}  LASSERT_NUMERIC(\"${method}\", a, ${i});\n")
+      set(param "(${atype})lval_to_long(a->cell[${i}])")
+    else()
+      message(FATAL_ERROR "Unsupported argument type ${atype} in: ${line}")
+    endif()
+    if(i EQUAL 0)
+      set(params "${param}")
+      set(signature "${atype}")
+    else()
+      set(params "${params}, ${param}")
+      set(signature "${signature}, ${atype}")
+    endif()
+    math(EXPR i "${i} + 1")
+  endwhile()
+
+  # Call and result conversion
+  set(call "static_cast<${klass}*>(obj)->${method}(${params})")
+  if(rtype STREQUAL "void")
+    set(body "  ${call};\n  lval_del(a);\n  return lval_qexpr();\n")
+  elseif(rtype STREQUAL "object")
+    set(body "  lval* r = lval_tobj(${call});\n  lval_del(a);\n  return r;\n")
+  elseif(rtype STREQUAL "newobject")
+    set(body "  lval* r = lval_tobj_owned(${call});\n  lval_del(a);\n  return r;\n")
+  elseif(rtype STREQUAL "dirobject")
+    set(body "  lval* r = lval_tobj_read(static_cast<${klass}*>(obj), ${call});\n  lval_del(a);\n  return r;\n")
+  elseif(rtype STREQUAL "string")
+    set(body "  lval* r = lval_str(${call});\n  lval_del(a);\n  return r;\n")
+  elseif(rtype STREQUAL "double" OR rtype STREQUAL "float")
+    set(body "  lval* r = lval_floating(${call});\n  lval_del(a);\n  return r;\n")
+  elseif(rtype MATCHES "^(bool|int|long|Long64_t)$")
+    set(body "  lval* r = lval_num((long)${call});\n  lval_del(a);\n  return r;\n")
+  else()
+    message(FATAL_ERROR "Unsupported return type ${rtype} in: ${line}")
+  endif()
+
+  set(name "native_${klass}_${method}_${index}")
+  set(functions "${functions}/* ${rtype} ${klass}::${method}(${signature}) */\nstatic lval* ${name}(TObject* obj, lval* a) {\n${checks}${body}}\n\n")
+  set(table "${table}  { \"${klass}\", \"${method}\", ${nargs}, ${name} },\n")
+  math(EXPR index "${index} + 1")
+endforeach()
+
+set(out "/* Generated from NativeBindings.list by GenerateNativeBindings.cmake. Do not edit. */\n\n")
+foreach(klass ${includes})
+  set(out "${out}#include \"${klass}.h\"\n")
+endforeach()
+set(out "${out}\n${functions}")
+set(out "${out}lnative_binding lnative_bindings[] = {\n${table}  { NULL, NULL, 0, NULL }\n};\n")
+
+file(WRITE ${OUTPUT}.tmp "${out}")
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different ${OUTPUT}.tmp ${OUTPUT})
+file(REMOVE ${OUTPUT}.tmp)
@@ -65,14 +65,119 @@ enum {
   MPC_INPUT_MARKS_MIN = 32
 };
 
+/*
+** Small allocations of the parse come from two
+** pools of fixed slots, with stacks of the free
+** ones, before falling back to malloc.
+*/
+
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_MEM_NUM = 512,
+  MPC_INPUT_MEM_LARGE_NUM = 64
 };
 
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+typedef struct {
+  char mem[256];
+} mpc_mem_large_t;
+
+/*
+** Arena
+**
+** Bump allocated blocks, growing up to 8MB,
+** which hold the AST nodes of a parse and are
+** all freed together.
+*/
+
+enum {
+  MPC_ARENA_BLOCK_MIN = 64 * 1024,
+  MPC_ARENA_BLOCK_MAX = 8 * 1024 * 1024
+};
+
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  size_t size;
+  size_t used;
+} mpc_arena_block_t;
+
+struct mpc_arena_t {
+  mpc_arena_block_t *blocks;
+  size_t block_size;
+  mpc_ast_t *root;
+};
+
+static mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *x = malloc(sizeof(mpc_arena_t));
+  x->blocks = NULL;
+  x->block_size = MPC_ARENA_BLOCK_MIN;
+  x->root = NULL;
+  return x;
+}
+
+static void mpc_arena_delete(mpc_arena_t *x) {
+  mpc_arena_block_t *b = x->blocks, *next;
+  while (b) {
+    next = b->next;
+    free(b);
+    b = next;
+  }
+  free(x);
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *x, size_t n) {
+  
+  mpc_arena_block_t *b = x->blocks;
+  size_t size;
+  
+  n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  
+  if (b == NULL || b->used + n > b->size) {
+    size = n > x->block_size ? n : x->block_size;
+    if (x->block_size < MPC_ARENA_BLOCK_MAX) { x->block_size *= 2; }
+    b = malloc(sizeof(mpc_arena_block_t) + size);
+    b->next = x->blocks;
+    b->size = size;
+    b->used = 0;
+    x->blocks = b;
+  }
+  
+  b->used += n;
+  return (char*)(b + 1) + b->used - n;
+}
+
+static int mpc_arena_owns(mpc_arena_t *x, void *p) {
+  mpc_arena_block_t *b;
+  for (b = x->blocks; b; b = b->next) {
+    if ((char*)p >= (char*)(b + 1) && (char*)p < (char*)(b + 1) + b->used) { return 1; }
+  }
+  return 0;
+}
+
+static mpc_ast_t *mpc_ast_new_in(mpc_arena_t *x, const char *tag, const char *contents);
+
+/*
+** Packrat memo entry: the result of a memoized
+** parser at some position, with the input state
+** it left, the error it failed with and the
+** errors it merged along the way. Errors are
+** kept in an arena freed with the input.
+*/
+
+typedef struct {
+  mpc_parser_t *parser;
+  long pos;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_dtor_t destructor;
+  mpc_err_t *error;
+  mpc_err_t *errors;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
@@ -80,6 +185,7 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
+  long length;
   char *buffer;
   FILE *file;
   
@@ -92,12 +198,35 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  int mem_free_num;
+  mpc_mem_t *mem_free[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
   
+  int mem_large_free_num;
+  mpc_mem_large_t *mem_large_free[MPC_INPUT_MEM_LARGE_NUM];
+  mpc_mem_large_t mem_large[MPC_INPUT_MEM_LARGE_NUM];
+  
+  int memo_num;
+  int memo_slots;
+  mpc_memo_t *memo;
+  mpc_arena_t *memo_arena;
+  
+  mpc_arena_t *arena;
+  
 } mpc_input_t;
 
+static void mpc_input_mem_init(mpc_input_t *i) {
+  int j;
+  i->mem_free_num = MPC_INPUT_MEM_NUM;
+  for (j = 0; j < MPC_INPUT_MEM_NUM; j++) {
+    i->mem_free[j] = i->mem + MPC_INPUT_MEM_NUM - 1 - j;
+  }
+  i->mem_large_free_num = MPC_INPUT_MEM_LARGE_NUM;
+  for (j = 0; j < MPC_INPUT_MEM_LARGE_NUM; j++) {
+    i->mem_large_free[j] = i->mem_large + MPC_INPUT_MEM_LARGE_NUM - 1 - j;
+  }
+}
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -108,7 +237,8 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
@@ -121,8 +251,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_mem_init(i);
+  
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+  i->memo_arena = NULL;
+  
+  i->arena = NULL;
   
   return i;
 }
@@ -138,6 +274,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
   
@@ -149,8 +286,14 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_mem_init(i);
+  
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+  i->memo_arena = NULL;
+  
+  i->arena = NULL;
   
   return i;
   
@@ -166,6 +309,7 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
   
@@ -177,14 +321,31 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_mem_init(i);
+  
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+  i->memo_arena = NULL;
+  
+  i->arena = NULL;
   
   return i;
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
   
+  int j;
+  
+  for (j = 0; j < i->memo_slots; j++) {
+    if (i->memo[j].parser == NULL) { continue; }
+    if (i->memo[j].success) { i->memo[j].destructor(i->memo[j].output); }
+  }
+  free(i->memo);
+  if (i->memo_arena) { mpc_arena_delete(i->memo_arena); }
+  
+  if (i->arena) { mpc_arena_delete(i->arena); }
+  
   free(i->filename);
   
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
@@ -195,29 +356,22 @@ static void mpc_input_delete(mpc_input_t *i) {
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+/* Size of the pool slot at p, or 0 if p was not taken from the pools */
+static size_t mpc_mem_size(mpc_input_t *i, void *p) {
+  if ((char*)p >= (char*)(i->mem) &&
+      (char*)p <  (char*)(i->mem + MPC_INPUT_MEM_NUM)) { return sizeof(mpc_mem_t); }
+  if ((char*)p >= (char*)(i->mem_large) &&
+      (char*)p <  (char*)(i->mem_large + MPC_INPUT_MEM_LARGE_NUM)) { return sizeof(mpc_mem_large_t); }
+  return 0;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
-  
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
-  
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
-  
+  if (n <= sizeof(mpc_mem_t) && i->mem_free_num > 0) {
+    return i->mem_free[--i->mem_free_num];
+  }
+  if (n <= sizeof(mpc_mem_large_t) && i->mem_large_free_num > 0) {
+    return i->mem_large_free[--i->mem_large_free_num];
+  }
   return malloc(n);
 }
 
@@ -228,21 +382,23 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  size_t size = mpc_mem_size(i, p);
+  if (size == 0) { free(p); return; }
+  if (size == sizeof(mpc_mem_t)) { i->mem_free[i->mem_free_num++] = p; }
+  else { i->mem_large_free[i->mem_large_free_num++] = p; }
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
   char *q = NULL;
+  size_t size = mpc_mem_size(i, p);
   
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  if (p == NULL) { return mpc_malloc(i, n); }
+  if (size == 0) { return realloc(p, n); }
   
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
+  if (n > size) {
+    q = mpc_malloc(i, n);
+    memcpy(q, p, size);
     mpc_free(i, p);
     return q;
   }
@@ -252,13 +408,25 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  size_t size = mpc_mem_size(i, p);
+  if (size == 0) { return p; }
+  q = malloc(size);
+  memcpy(q, p, size);
   mpc_free(i, p);
   return q; 
 }
 
+/*
+** Values handed to user functions may outlive
+** the parse, so trees in its arena are copied
+** out for them.
+*/
+
+static void *mpc_export_val(mpc_input_t *i, void *p) {
+  if (i->arena && mpc_arena_owns(i->arena, p)) { return mpc_ast_copy(p); }
+  return mpc_export(i, p);
+}
+
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
@@ -331,7 +499,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -681,10 +849,13 @@ static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expecte
   return 0;
 }
 
+/* Lists of expected are grown in powers of two */
 static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
+  if ((x->expected_num & (x->expected_num - 1)) == 0) {
+    x->expected = mpc_realloc(i, x->expected,
+      sizeof(char*) * (x->expected_num ? x->expected_num * 2 : 1));
+  }
   x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
   x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
   strcpy(x->expected[x->expected_num-1], expected);
 }
@@ -819,6 +990,37 @@ static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   return mpc_err_or(i, errs, 2);
 }
 
+/* Errors are copied into the arena a, when given, or taken from the input */
+static void *mpc_err_alloc(mpc_input_t *i, mpc_arena_t *a, size_t n) {
+  return a ? mpc_arena_alloc(a, n) : mpc_malloc(i, n);
+}
+
+static char *mpc_err_strdup(mpc_input_t *i, mpc_arena_t *a, const char *x) {
+  char *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_err_alloc(i, a, strlen(x) + 1);
+  strcpy(y, x);
+  return y;
+}
+
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_arena_t *a, mpc_err_t *x) {
+  int j, n = 1;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  while (n < x->expected_num) { n *= 2; }
+  y = mpc_err_alloc(i, a, sizeof(mpc_err_t));
+  y->state = x->state;
+  y->recieved = x->recieved;
+  y->filename = mpc_err_strdup(i, a, x->filename);
+  y->failure = mpc_err_strdup(i, a, x->failure);
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? mpc_err_alloc(i, a, sizeof(char*) * n) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_err_strdup(i, a, x->expected[j]);
+  }
+  return y;
+}
+
 /*
 ** Parser Type
 */
@@ -893,6 +1095,8 @@ struct mpc_parser_t {
   char *name;
   char type;
   mpc_pdata_t data;
+  mpc_apply_t memo_copy;
+  mpc_dtor_t memo_dtor;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -935,7 +1139,8 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
-  for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
+  if (f == mpcf_fold_ast)  { return mpcf_fold_ast(n, xs); }
+  for (j = 0; j < n; j++) { xs[j] = mpc_export_val(i, xs[j]); }
   return f(j, xs);
 }
 
@@ -944,25 +1149,38 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
   return NULL;
 }
 
-static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c, int arena) {
+  mpc_ast_t *a;
+  if (arena && i->arena == NULL) { i->arena = mpc_arena_new(); }
+  a = mpc_ast_new_in(arena ? i->arena : NULL, "", c);
   mpc_free(i, c);
   return a;
 }
 
+static mpc_val_t *mpc_parse_lift(mpc_input_t *i, mpc_ctor_t f) {
+  if (f == mpcf_ctor_str) { return mpc_calloc(i, 1, 1); }
+  return f();
+}
+
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
-  return f(mpc_export(i, x));
+  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x, 0); }
+  if (f == mpcf_arena_ast) { return mpcf_input_str_ast(i, x, 1); }
+  if (f == mpcf_copy_ast) { return mpcf_copy_ast(x); }
+  if (f == (mpc_apply_t)mpc_ast_add_root) { return mpc_ast_add_root(x); }
+  return f(mpc_export_val(i, x));
 }
 
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+  if (f == (mpc_apply_to_t)mpc_ast_tag)     { return mpc_ast_tag(x, d); }
+  if (f == (mpc_apply_to_t)mpc_ast_add_tag) { return mpc_ast_add_tag(x, d); }
+  return f(mpc_export_val(i, x), d);
 }
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   if (d == free) { mpc_free(i, x); return; }
-  d(mpc_export(i, x));
+  if (d == (mpc_dtor_t)mpc_ast_delete) { mpc_ast_delete(x); return; }
+  d(mpc_export_val(i, x));
 }
 
 enum {
@@ -975,8 +1193,107 @@ enum {
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
+/*
+** Packrat Memo Table
+**
+** Open addressing on parser and position, kept
+** at most half full.
+*/
+
+static mpc_memo_t *mpc_memo_slot(mpc_memo_t *memo, int slots, mpc_parser_t *p, long pos) {
+  size_t h = ((size_t)p >> 4) * 2654435761u + (size_t)pos * 40503u;
+  size_t j = h & (size_t)(slots - 1);
+  while (memo[j].parser && (memo[j].parser != p || memo[j].pos != pos)) {
+    j = (j + 1) & (size_t)(slots - 1);
+  }
+  return &memo[j];
+}
+
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  if (i->memo_slots == 0) { return NULL; }
+  return mpc_memo_slot(i->memo, i->memo_slots, p, pos);
+}
+
+static mpc_memo_t *mpc_memo_insert(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  
+  int j;
+  mpc_memo_t *m, *old = i->memo;
+  int old_slots = i->memo_slots;
+  
+  if ((i->memo_num + 1) * 2 > i->memo_slots) {
+    i->memo_slots = i->memo_slots ? i->memo_slots * 2 : 1024;
+    i->memo = calloc(i->memo_slots, sizeof(mpc_memo_t));
+    for (j = 0; j < old_slots; j++) {
+      if (old[j].parser == NULL) { continue; }
+      *mpc_memo_slot(i->memo, i->memo_slots, old[j].parser, old[j].pos) = old[j];
+    }
+    free(old);
+  }
+  
+  m = mpc_memo_slot(i->memo, i->memo_slots, p, pos);
+  m->parser = p;
+  m->pos = pos;
+  i->memo_num++;
+  return m;
+}
+
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  int x;
+  long pos = i->state.pos;
+  mpc_err_t *errors = NULL;
+  mpc_memo_t *m = mpc_memo_find(i, p, pos);
+  
+  if (m && m->parser) {
+    i->state = m->state;
+    i->last = m->last;
+    if (m->errors) { *e = mpc_err_merge(i, *e, mpc_err_copy(i, NULL, m->errors)); }
+    if (m->success) {
+      r->output = m->output ? p->memo_copy(m->output) : NULL;
+    } else {
+      r->error = mpc_err_copy(i, NULL, m->error);
+    }
+    return m->success;
+  }
+  
+  /* Errors merged by the parser are collected apart to be replayed */
+  x = mpc_parse_step(i, p, r, &errors);
+  
+  m = mpc_memo_insert(i, p, pos);
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  m->destructor = p->memo_dtor;
+  if (i->memo_arena == NULL) { i->memo_arena = mpc_arena_new(); }
+  m->errors = mpc_err_copy(i, i->memo_arena, errors);
+  if (x) {
+    r->output = mpc_export(i, r->output);
+    m->output = r->output ? p->memo_copy(r->output) : NULL;
+    m->error = NULL;
+  } else {
+    m->output = NULL;
+    m->error = mpc_err_copy(i, i->memo_arena, r->error);
+  }
+  
+  *e = mpc_err_merge(i, *e, errors);
+  return x;
+}
+
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
+  /* Only string inputs can jump back to cached positions */
+  if (p->memo_copy && i->type == MPC_INPUT_STRING
+  &&  i->suppress == 0 && i->backtrack > 0) {
+    return mpc_parse_memo(i, p, r, e);
+  }
+  
+  return mpc_parse_step(i, p, r, e);
+}
+
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
   mpc_result_t *results;
@@ -1000,7 +1317,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
     case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
     case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(mpc_parse_lift(i, p->data.lift.lf));
     case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
     
@@ -1055,7 +1372,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       } else {
         mpc_input_unmark(i);
         mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
+        MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
       }
     
     case MPC_TYPE_MAYBE:
@@ -1063,7 +1380,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         MPC_SUCCESS(r->output);
       } else {
         *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
+        MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
       }
     
     /* Repeat Parsers */
@@ -1208,7 +1525,13 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   x = mpc_parse_run(i, p, r, &e);
   if (x) {
     mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
+    if (i->arena && mpc_arena_owns(i->arena, r->output)) {
+      /* The tree returned takes the arena over */
+      i->arena->root = r->output;
+      i->arena = NULL;
+    } else {
+      r->output = mpc_export(i, r->output);
+    }
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
@@ -1364,6 +1687,12 @@ mpc_parser_t *mpc_new(const char *name) {
   return p;
 }
 
+mpc_parser_t *mpc_memoize(mpc_parser_t *p, mpc_apply_t c, mpc_dtor_t d) {
+  p->memo_copy = c;
+  p->memo_dtor = d;
+  return p;
+}
+
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
@@ -2557,6 +2886,11 @@ void mpc_ast_delete(mpc_ast_t *a) {
   
   if (a == NULL) { return; }
   
+  if (a->arena) {
+    if (a->arena->root == a) { mpc_arena_delete(a->arena); }
+    return;
+  }
+  
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
@@ -2569,30 +2903,69 @@ void mpc_ast_delete(mpc_ast_t *a) {
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
   free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+static void *mpc_ast_alloc(mpc_arena_t *x, size_t n) {
+  return x ? mpc_arena_alloc(x, n) : malloc(n);
+}
+
+static mpc_ast_t *mpc_ast_new_in(mpc_arena_t *x, const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_t *a = mpc_ast_alloc(x, sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
+  a->tag = mpc_ast_alloc(x, strlen(tag) + 1);
   strcpy(a->tag, tag);
   
-  a->contents = malloc(strlen(contents) + 1);
+  a->contents = mpc_ast_alloc(x, strlen(contents) + 1);
   strcpy(a->contents, contents);
   
   a->state = mpc_state_new();
   
   a->children_num = 0;
   a->children = NULL;
+  a->arena = x;
   return a;
   
 }
 
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  return mpc_ast_new_in(NULL, tag, contents);
+}
+
+/*
+** Children of arena nodes are allocated in powers
+** of two, so that adding one copies them only when
+** their number reaches the next power.
+*/
+
+static mpc_ast_t *mpc_ast_copy_in(mpc_arena_t *x, mpc_ast_t *a) {
+  
+  int i, n = 1;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return a; }
+  
+  b = mpc_ast_new_in(x, a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  if (x) { while (n < a->children_num) { n *= 2; } } else { n = a->children_num; }
+  b->children = a->children_num ? mpc_ast_alloc(x, sizeof(mpc_ast_t*) * n) : NULL;
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy_in(x, a->children[i]);
+  }
+  return b;
+  
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  return mpc_ast_copy_in(NULL, a);
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2619,7 +2992,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_in(a->arena, ">", "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2640,6 +3013,26 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  
+  mpc_ast_t *b, **children;
+  
+  if (a && a->arena != r->arena) {
+    b = mpc_ast_copy_in(r->arena, a);
+    mpc_ast_delete(a);
+    a = b;
+  }
+  
+  if (r->arena) {
+    if ((r->children_num & (r->children_num - 1)) == 0) {
+      children = mpc_arena_alloc(r->arena,
+        sizeof(mpc_ast_t*) * (r->children_num ? r->children_num * 2 : 1));
+      if (r->children_num) { memcpy(children, r->children, sizeof(mpc_ast_t*) * r->children_num); }
+      r->children = children;
+    }
+    r->children[r->children_num++] = a;
+    return r;
+  }
+  
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
@@ -2647,7 +3040,16 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  char *tag;
   if (a == NULL) { return a; }
+  if (a->arena) {
+    tag = mpc_arena_alloc(a->arena, strlen(t) + 1 + strlen(a->tag) + 1);
+    strcpy(tag, t);
+    strcat(tag, "|");
+    strcat(tag, a->tag);
+    a->tag = tag;
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2656,6 +3058,11 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->arena) {
+    a->tag = mpc_arena_alloc(a->arena, strlen(t) + 1);
+    strcpy(a->tag, t);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2706,13 +3113,15 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   int i, j;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
+  mpc_arena_t *x = NULL;
   
   if (n == 0) { return NULL; }
   if (n == 1) { return xs[0]; }
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
   
-  r = mpc_ast_new(">", "");
+  for (i = 0; i < n && x == NULL; i++) { if (as[i]) { x = as[i]->arena; } }
+  r = mpc_ast_new_in(x, ">", "");
   
   for (i = 0; i < n; i++) {
     
@@ -2745,6 +3154,11 @@ mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   return a;
 }
 
+/* Outside of a parse there is no arena to allocate from */
+mpc_val_t *mpcf_arena_ast(mpc_val_t *c) {
+  return mpcf_str_ast(c);
+}
+
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
   mpc_state_t *s = ((mpc_state_t**)xs)[0];
   mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
@@ -2754,6 +3168,37 @@ mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
   return a;
 }
 
+mpc_val_t *mpcf_copy_ast(mpc_val_t *a) {
+  if (a == NULL) { return a; }
+  return mpc_ast_copy_in(((mpc_ast_t*)a)->arena, a);
+}
+
+/*
+** Packrat results in an arena are shared rather
+** than copied: only the node handed out is new,
+** as the rule using it tags and places it, while
+** its children, never changed once built, are the
+** memo's. Other trees have to be copied whole.
+*/
+
+static mpc_val_t *mpcaf_memo_ast(mpc_val_t *a) {
+  
+  int n = 1;
+  mpc_ast_t *x = a, *y;
+  
+  if (x == NULL || x->arena == NULL) { return mpcf_copy_ast(a); }
+  
+  y = mpc_arena_alloc(x->arena, sizeof(mpc_ast_t));
+  *y = *x;
+  if (x->children_num) {
+    while (n < x->children_num) { n *= 2; }
+    y->children = mpc_arena_alloc(x->arena, sizeof(mpc_ast_t*) * n);
+    memcpy(y->children, x->children, sizeof(mpc_ast_t*) * x->children_num);
+  }
+  return y;
+  
+}
+
 mpc_parser_t *mpca_state(mpc_parser_t *a) {
   return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
 }
@@ -2908,7 +3353,7 @@ static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+  return mpca_state(mpca_tag(mpc_apply(p, (st->flags & MPCA_LANG_ARENA) ? mpcf_arena_ast : mpcf_str_ast), "string"));
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
@@ -2916,7 +3361,7 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+  return mpca_state(mpca_tag(mpc_apply(p, (st->flags & MPCA_LANG_ARENA) ? mpcf_arena_ast : mpcf_str_ast), "char"));
 }
 
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
@@ -2924,7 +3369,7 @@ static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape_regex(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+  return mpca_state(mpca_tag(mpc_apply(p, (st->flags & MPCA_LANG_ARENA) ? mpcf_arena_ast : mpcf_str_ast), "regex"));
 }
 
 /* Should this just use `isdigit` instead? */
@@ -3141,6 +3586,9 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
+    if (st->flags & MPCA_LANG_PACKRAT) {
+      mpc_memoize(left, mpcaf_memo_ast, (mpc_dtor_t)mpc_ast_delete);
+    }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -87,6 +87,18 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
 
+/*
+** Packrat Parsing
+**
+** The results of a memoized parser are cached
+** for each position of a string input, so that
+** backtracking never runs it twice at the same
+** place. Results are handed out as copies made
+** with `c` and cached ones are freed with `d`.
+*/
+
+mpc_parser_t *mpc_memoize(mpc_parser_t *p, mpc_apply_t c, mpc_dtor_t d);
+
 /*
 ** Basic Parsers
 */
@@ -253,14 +265,32 @@ mpc_parser_t *mpc_re(const char *re);
   
 /*
 ** AST
+**
+** Trees built from leaves made by `mpcf_arena_ast`,
+** as in grammars given `MPCA_LANG_ARENA`, are
+** allocated from an arena which belongs to the
+** root returned by the parse. Deleting the root
+** frees the whole tree in one go and deleting any
+** other node does nothing, so no node of it may
+** be kept once the root is deleted: copy it with
+** `mpc_ast_copy`, which returns a tree of its own,
+** first. Nodes of failed branches are only freed
+** with the root, user functions applied during the
+** parse are given copies, and nodes added to an
+** arena tree are moved into its arena. Trees built
+** from `mpcf_str_ast` leaves are allocated node by
+** node, each node owning its children.
 */
 
+typedef struct mpc_arena_t mpc_arena_t;
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  mpc_arena_t *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -280,9 +310,13 @@ void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
 */
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
+mpc_val_t *mpcf_arena_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
+mpc_val_t *mpcf_copy_ast(mpc_val_t *a); /* Copies into the same arena */
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
@@ -303,7 +337,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4,
+  MPCA_LANG_ARENA                = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
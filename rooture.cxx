@@ -1,4 +1,10 @@
 #include <editline/readline.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <unistd.h>
 #include <cstdlib>
 #include <cstdio>
 #include "ROOTureApp.h"
@@ -16,24 +22,77 @@
 #include "TException.h"
 #include "TInterpreter.h"
 #include "TMethod.h"
+#include "TRealData.h"
+#include "TDataMember.h"
+#include "TDataType.h"
 #include "TFile.h"
 #include "TRandom.h"
+#include "TH1.h"
+#include "TTree.h"
+#include "TKey.h"
+#include "TTimer.h"
+#include "TList.h"
+#include "TAxis.h"
+#include "TChain.h"
+#include "TThread.h"
+#include "RVersion.h"
+#include "TH1D.h"
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,16,0)
+#include "ROOT/RDataFrame.hxx"
+#else
+#include "TTreeFormula.h"
+#endif
+#include "TObjArray.h"
+#include "TCollection.h"
+#include "TGraph.h"
+#include "TArrayD.h"
+#include "TArrayF.h"
+#include "TArrayI.h"
+#include "TArrayS.h"
+#include "TArrayC.h"
+#include "TVectorD.h"
+#include "TVectorF.h"
+#include "TBranch.h"
+#include "TLeaf.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 extern "C"
 {
 #include "mpc.h"
 }
 
+#define ROOTURE_VERSION "0.1.0"
+
 /* Create Enumeration of Possible lval Types */
 enum { LVAL_ERR, LVAL_NUM,  LVAL_FLOAT, LVAL_SYM, LVAL_STR,
-       LVAL_FUN, LVAL_TOBJ, LVAL_TMETHOD, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_TOBJ, LVAL_TMETHOD, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_SEQ, LVAL_ARRAY, LVAL_HANDLE };
 
 struct lval;
 struct lenv;
+struct lobj;
+struct lbuf;
+struct lhandle;
+struct ljump;
 void lval_del(lval* v);
 int lval_eq(lval* x, lval* y);
 lval* lval_copy(lval* v);
+lval* lglobal_lookup(const char* name);
+void lroot_init();
 lval* lval_err(const char* fmt, ...);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
@@ -59,9 +118,27 @@ struct lval {
   char* str;
   /* TObject related */
   TObject *obj;
+  lobj *ref;
   TMethodCall *method;
   char *methodArgs;
 
+  /* Sequence over a TCollection. The current element is kept in obj
+     (NULL once exhausted) and the owner of the collection in ref. */
+  TCollection *coll;
+  TIterator *iter;
+  int index;
+
+  /* Numeric array of length elements of type atype (an EDataType). The
+     memory either belongs to buf or, for views, to the object in ref. */
+  void *data;
+  long length;
+  int atype;
+  int readonly;
+  lbuf *buf;
+
+  /* Native resource managed by builtins, e.g. a tree reader */
+  lhandle *handle;
+
   /* Function */
   lbuiltin builtin;
   lenv* env;
@@ -71,6 +148,8 @@ struct lval {
   /* Expression */
   int count;
   lval** cell;
+  /* Jump table, when the expression is a case form, see ljump */
+  ljump* jump;
 };
 
 /* Parsers */
@@ -121,10 +200,13 @@ lval* lenv_get(lenv* e, lval* k) {
   }
 
   /* If no symbol check in parent. If we are at top level then we bind a
-     symbol to a string which has the same value. */
+     symbol to a string which has the same value, unless it names one of
+     ROOT's globals. */
   if (e->par) {
     return lenv_get(e->par, k);
   } else {
+    lval* g = lglobal_lookup(k->sym);
+    if (g) { return g; }
     lval *v = lval_str(k->sym);
     lenv_put(e, k, v);
     return v;
@@ -176,6 +258,7 @@ void lenv_def(lenv* e, lval* k, lval* v) {
   lenv_put(e, k, v);
 }
 
+// Evaluate an expression
 lval* lval_eval(lenv* e, lval* v) {
   if (v->type == LVAL_SYM) {
     lval* x = lenv_get(e, v);
@@ -197,14 +280,261 @@ lval* lval_fun(lbuiltin func) {
   return v;
 }
 
-/* Create a new TObject lval */
+/* Shared ownership record for TObjects created by ROOTure. All copies of
+   an owned LVAL_TOBJ point to the same lobj and the object is deleted
+   when the last of them goes away. Borrowed objects (globals, objects
+   returned by ROOT) have no lobj and are never deleted by us. Counts
+   are atomic since values are shared with tree-fold workers. */
+struct lobj {
+  TObject* obj;
+  std::atomic<int> refs;
+  char* pool_key;   /* constructor call, if the object can be recycled */
+};
+
+/* Number of owned objects currently alive, see builtin_live_objects */
+std::atomic<long> lobj_live(0);
+
+/* Guards the lookup caches and the object pool against worker threads */
+std::mutex lglobal_mutex;
+
+/* Set on tree-fold worker threads, which must not delete TObjects, look
+   at ROOT's lists or touch objects shared with the main thread */
+thread_local bool lworker = false;
+
+void lobj_release(lobj* r);
+
+/* Records that the script used obj, see lredraw */
+void lredraw_touch(TObject* obj);
+void lredraw_touch_value(lval* v);
+
+/* Create a new TObject lval which does not own the object */
 lval* lval_tobj(TObject *obj) {
   lval* v = (lval*)malloc(sizeof(lval));
   v->type = LVAL_TOBJ;
   v->obj = obj;
+  v->ref = NULL;
+  return v;
+}
+
+/* Owned objects by address. ROOT can still delete one of them, e.g. a
+   histogram created in a file when the file is closed, so owned objects
+   are marked kMustCleanup: ROOT then calls lobj_cleaner, which clears the
+   object from its lobj before the memory goes away. lobj_release never
+   looks at an object that is no longer there. */
+std::unordered_map<TObject*, lobj*> lobj_registry;
+std::mutex lobj_mutex;
+
+class lobj_cleaner : public TObject {
+public:
+  void RecursiveRemove(TObject* obj) {
+    std::lock_guard<std::mutex> lock(lobj_mutex);
+    std::unordered_map<TObject*, lobj*>::iterator it = lobj_registry.find(obj);
+    if (it == lobj_registry.end()) { return; }
+    it->second->obj = NULL;
+    lobj_registry.erase(it);
+  }
+};
+
+/* Create a new TObject lval which owns the object. An object which is
+   already owned, e.g. one wrapped again by a native binding, shares the
+   existing lobj. */
+lval* lval_tobj_owned(TObject *obj) {
+  lval* v = lval_tobj(obj);
+  if (!obj) { return v; }
+  std::lock_guard<std::mutex> lock(lobj_mutex);
+  lobj*& r = lobj_registry[obj];
+  if (!r) {
+    static bool installed = false;
+    if (!installed) {
+      /* Never deleted: ROOT may call it until the very end */
+      gROOT->GetListOfCleanups()->Add(new lobj_cleaner());
+      installed = true;
+    }
+    obj->SetBit(TObject::kMustCleanup);
+    r = new lobj();
+    r->obj = obj;
+    r->refs = 0;
+    r->pool_key = NULL;
+    lobj_live++;
+  }
+  r->refs++;
+  v->ref = r;
+  return v;
+}
+
+/* Create a TObject lval for an object that lives inside (or is owned by)
+   another one, keeping the owner alive for as long as it is referenced. */
+lval* lval_tobj_shared(TObject *obj, lobj *owner) {
+  lval* v = lval_tobj(obj);
+  v->ref = owner;
+  if (owner) { owner->refs++; }
+  return v;
+}
+
+/* Whether ROOT deleted the object behind v, or the object it lives in,
+   since v was made. Views and sequences are checked through their owner. */
+bool lval_deleted(lval* v) {
+  return (v->type == LVAL_TOBJ || v->type == LVAL_SEQ || v->type == LVAL_ARRAY)
+    && v->ref && !v->ref->obj;
+}
+
+/* Memory of an array created by ROOTure, shared by all its copies */
+struct lbuf {
+  void* data;
+  std::atomic<int> refs;
+};
+
+void lbuf_release(lbuf* b) {
+  free(b->data);
+  delete b;
+}
+
+/* Size in bytes of the array element types we support */
+int larray_size(int atype) {
+  switch (atype) {
+    case kDouble_t: case kLong64_t: case kULong64_t: return 8;
+    case kFloat_t: case kInt_t: case kUInt_t: return 4;
+    case kShort_t: case kUShort_t: return 2;
+    case kChar_t: case kUChar_t: case kBool_t: return 1;
+    default: return 0;
+  }
+}
+
+const char* larray_type_name(int atype) {
+  switch (atype) {
+    case kDouble_t: return "double";
+    case kFloat_t: return "float";
+    case kLong64_t: return "long64";
+    case kULong64_t: return "ulong64";
+    case kInt_t: return "int";
+    case kUInt_t: return "uint";
+    case kShort_t: return "short";
+    case kUShort_t: return "ushort";
+    case kChar_t: return "char";
+    case kUChar_t: return "uchar";
+    case kBool_t: return "bool";
+    default: return "unknown";
+  }
+}
+
+/* An array aliasing memory that belongs to someone else, typically a ROOT
+   object which is kept alive through owner. */
+lval* lval_array_view(void* data, long length, int atype, int readonly, lobj* owner) {
+  lval* v = (lval*)malloc(sizeof(lval));
+  v->type = LVAL_ARRAY;
+  v->data = data;
+  v->length = length;
+  v->atype = atype;
+  v->readonly = readonly;
+  v->buf = NULL;
+  v->ref = owner;
+  if (owner) { owner->refs++; }
+  return v;
+}
+
+/* A new zero filled array, or an error if there is no memory for it */
+lval* lval_array(long length, int atype) {
+  void* data = calloc(length ? length : 1, larray_size(atype));
+  if (!data) {
+    return lval_err("Could not allocate an array of %li elements of type %s.", length,
+                    larray_type_name(atype));
+  }
+  lval* v = lval_array_view(data, length, atype, 0, NULL);
+  v->buf = new lbuf();
+  v->buf->data = data;
+  v->buf->refs = 1;
+  return v;
+}
+
+/* Base of the native resources builtins hand out to scripts (readers,
+   writers, ...). Like owned objects they are shared between copies and
+   destroyed together with the last one. */
+struct lhandle {
+  std::atomic<int> refs;
+  lhandle() : refs(0) {}
+  virtual ~lhandle() {}
+  virtual const char* Kind() const = 0;
+};
+
+lval* lval_handle(lhandle* h) {
+  lval* v = (lval*)malloc(sizeof(lval));
+  v->type = LVAL_HANDLE;
+  v->handle = h;
+  h->refs++;
   return v;
 }
 
+/* Jump table of a form (case x {c1 v1} {c2 v2} ...) whose constants are
+   all literal integers or strings: the argument holding the clause to take
+   for each constant. Such forms in the body of a function get an empty
+   table when the function is made (see ljump_attach), which copies of the
+   body share and builtin_case fills the first time one is evaluated, so
+   that later calls jump to their clause without comparing x with every
+   constant. */
+struct ljump {
+  std::atomic<int> refs;
+  std::once_flag filled;
+  bool usable;
+  int count;   /* arguments of the form, without 'case' */
+  std::unordered_map<long, int> nums;
+  std::unordered_map<std::string, int> strs;
+};
+
+/* Whether the clauses of v, from first on, all have a literal integer or
+   string constant */
+bool ljump_literal(lval* v, int first) {
+  if (v->count <= first) { return false; }
+  for (int i = first; i < v->count; i++) {
+    lval* c = v->cell[i];
+    if (c->type != LVAL_QEXPR || c->count < 2
+        || (c->cell[0]->type != LVAL_NUM && c->cell[0]->type != LVAL_STR)) { return false; }
+  }
+  return true;
+}
+
+/* Gives v a jump table to fill if it is a case form */
+void ljump_form(lval* v) {
+  if (v->jump || v->count < 3
+      || v->cell[0]->type != LVAL_SYM || strcmp(v->cell[0]->sym, "case") != 0
+      || !ljump_literal(v, 2)) { return; }
+  v->jump = new ljump();
+  v->jump->refs = 1;
+  v->jump->usable = false;
+  v->jump->count = v->count - 1;
+}
+
+/* Gives the case forms in v a jump table to fill */
+void ljump_attach(lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+  for (int i = 0; i < v->count; i++) { ljump_attach(v->cell[i]); }
+  if (v->type == LVAL_SEXPR) { ljump_form(v); }
+}
+
+/* Fills j from the arguments a of the case form, see builtin_case */
+void ljump_fill(ljump* j, lval* a) {
+  j->usable = ljump_literal(a, 1);
+  for (int i = 1; i < a->count && j->usable; i++) {
+    lval* c = a->cell[i]->cell[0];
+    /* The first clause with a constant wins, as in a sequential search */
+    if (c->type == LVAL_NUM) {
+      j->nums.insert(std::make_pair(c->num, i));
+    } else {
+      j->strs.insert(std::make_pair(std::string(c->str), i));
+    }
+  }
+}
+
+/* The jump table shared with a copy of v, if it has one */
+ljump* ljump_share(lval* v) {
+  if (v->jump) { v->jump->refs++; }
+  return v->jump;
+}
+
+void ljump_release(lval* v) {
+  if (v->jump && --v->jump->refs == 0) { delete v->jump; }
+  v->jump = NULL;
+}
+
 /* Create a new TMethodCall lval */
 lval* lval_tmethod(TMethodCall *method, const char *args) {
   lval* v = (lval*)malloc(sizeof(lval));
@@ -250,6 +580,10 @@ lval* lval_lambda(lval* formals, lval* body) {
   /* Set Formals and Body */
   v->formals = formals;
   v->body = body;
+  ljump_attach(body);
+  /* The body is evaluated as an S-Expression, so it may be a case form
+     itself, as in (fun {f x} {case x ...}) */
+  if (body->type == LVAL_QEXPR) { ljump_form(body); }
   return v;  
 }
 
@@ -265,6 +599,9 @@ const char* ltype_name(int t) {
     case LVAL_TMETHOD: return "Method";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_SEQ: return "Sequence";
+    case LVAL_ARRAY: return "Array";
+    case LVAL_HANDLE: return "Handle";
     default: return "Unknown";
   }
 }
@@ -306,6 +643,7 @@ lval* lval_sexpr(void) {
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->jump = NULL;
   return v;
 }
 
@@ -315,6 +653,7 @@ lval* lval_qexpr(void) {
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->jump = NULL;
   return v;
 }
 
@@ -329,11 +668,22 @@ void lval_del(lval* v) {
       }
     break;
     case LVAL_TOBJ:
-    // FIXME: Reference counting TObjects?
+      if (v->ref && --v->ref->refs == 0) { lobj_release(v->ref); }
     break;
     case LVAL_TMETHOD:
     // FIXME: reference counting TMethods?
     break;
+    case LVAL_SEQ:
+      delete v->iter;
+      if (v->ref && --v->ref->refs == 0) { lobj_release(v->ref); }
+    break;
+    case LVAL_ARRAY:
+      if (v->buf && --v->buf->refs == 0) { lbuf_release(v->buf); }
+      if (v->ref && --v->ref->refs == 0) { lobj_release(v->ref); }
+    break;
+    case LVAL_HANDLE:
+      if (--v->handle->refs == 0) { delete v->handle; }
+    break;
     /* Do nothing special for number type */
     case LVAL_NUM: break;
     case LVAL_FLOAT: break;
@@ -350,6 +700,7 @@ void lval_del(lval* v) {
       }
       /* Also free the memory allocated to contain the pointers */
       free(v->cell);
+      ljump_release(v);
     break;
   }
 
@@ -372,12 +723,15 @@ lval* lval_read_floating(mpc_ast_t* t) {
 }
 
 lval* lval_add(lval* v, lval* x) {
+  /* Jump tables only hold for the form they were made from */
+  if (v->jump) { ljump_release(v); }
   v->count++;
   v->cell = (lval **)realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
   return v;
 }
 void lval_print(lval* v);
+void lval_print_array(lval* v);
 
 void lval_expr_print(lval* v, char open, char close) {
   putchar(open);
@@ -458,8 +812,8 @@ void lval_print(lval* v) {
       }
     break;
     case LVAL_TOBJ:
-      printf("<tobject @%llx>\n", (int64_t)v->obj);
-      if (v->obj)
+      printf("<tobject @%llx%s>\n", (int64_t)v->obj, lval_deleted(v) ? ", deleted" : "");
+      if (v->obj && !lval_deleted(v))
         v->obj->Print();
     break;
     case LVAL_TMETHOD:
@@ -469,11 +823,29 @@ void lval_print(lval* v) {
     case LVAL_STR:   lval_print_str(v); break;
     case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
     case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+    case LVAL_SEQ:
+      printf("<sequence over %s @%llx>", v->coll->ClassName(), (int64_t)v->coll);
+    break;
+    case LVAL_ARRAY: lval_print_array(v); break;
+    case LVAL_HANDLE:
+      printf("<%s @%llx>", v->handle->Kind(), (int64_t)v->handle);
+    break;
   }
 }
 
 void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 
+double larray_get(lval* a, long i);
+
+void lval_print_array(lval* v) {
+  printf("<%sarray %s[%li]", v->buf ? "" : "view ",
+    larray_type_name(v->atype), v->length);
+  for (long i = 0; i < v->length && i < 8; i++) {
+    printf(" %g", larray_get(v, i));
+  }
+  printf(v->length > 8 ? " ...>" : ">");
+}
+
 lval* lval_read_str(mpc_ast_t* t) {
   /* Cut off the final quote character */
   t->contents[strlen(t->contents)-1] = '\0';
@@ -516,6 +888,226 @@ lval* lval_read(mpc_ast_t* t) {
   return x;
 }
 
+/* Reader. Builds lvals directly from the source in a single pass, with the
+   syntax of the mpc grammar in lgrammar_init, which is kept as a reference
+   (see lreader_bench): at each point the first of floating, number,
+   symbol, string, comment, sexpr and qexpr which matches is taken, so that
+   e.g. 1abc reads as 1 followed by abc. Errors are reported at the same
+   positions and in the same format as mpc. */
+enum { LCH_SPACE = 1, LCH_DIGIT = 2, LCH_SYMBOL = 4 };
+
+struct lreader_table {
+  unsigned char cls[256];
+  lreader_table() {
+    memset(cls, 0, sizeof(cls));
+    for (const char* c = " \f\n\r\t\v"; *c; c++) { cls[(unsigned char)*c] = LCH_SPACE; }
+    for (int c = 'a'; c <= 'z'; c++) { cls[c] = LCH_SYMBOL; }
+    for (int c = 'A'; c <= 'Z'; c++) { cls[c] = LCH_SYMBOL; }
+    for (int c = '0'; c <= '9'; c++) { cls[c] = LCH_DIGIT | LCH_SYMBOL; }
+    for (const char* c = "_+-*/\\=<>!&."; *c; c++) { cls[(unsigned char)*c] = LCH_SYMBOL; }
+  }
+};
+
+const lreader_table lreader_chars;
+
+struct lreader {
+  const char* name;
+  const char* data;   /* the part of the input in memory */
+  const char* p;
+  const char* end;
+  long offset;        /* position of data in the input */
+  long line;          /* position of the current line, for columns */
+  int row;
+  lval* err;          /* set on syntax errors */
+};
+
+void lreader_init(lreader* r, const char* name, const char* data, size_t size) {
+  r->name = name;
+  r->data = r->p = data;
+  r->end = data + size;
+  r->offset = 0;
+  r->line = 0;
+  r->row = 0;
+  r->err = NULL;
+}
+
+inline void lreader_newline(lreader* r, const char* q) {
+  r->row++;
+  r->line = r->offset + (q + 1 - r->data);
+}
+
+inline int lreader_is(lreader* r, const char* q, int cls) {
+  return q < r->end && (lreader_chars.cls[(unsigned char)*q] & cls);
+}
+
+lval* lreader_error(lreader* r, const char* expected) {
+  char quoted[4] = { '\'', r->p < r->end ? *r->p : '\0', '\'', '\0' };
+  const char* received = quoted;
+  switch (quoted[1]) {
+    case '\a': received = "bell"; break;
+    case '\b': received = "backspace"; break;
+    case '\f': received = "formfeed"; break;
+    case '\r': received = "carriage return"; break;
+    case '\v': received = "vertical tab"; break;
+    case '\0': received = "end of input"; break;
+    case '\n': received = "newline"; break;
+    case '\t': received = "tab"; break;
+    case ' ': received = "space"; break;
+  }
+  r->err = lval_err("%s:%i:%i: error: expected %s at %s\n", r->name, r->row + 1,
+    (int)(r->offset + (r->p - r->data) - r->line) + 1, expected, received);
+  return NULL;
+}
+
+/* Skip white space and comments */
+void lreader_skip(lreader* r) {
+  while (r->p < r->end) {
+    char c = *r->p;
+    if (c == '\n') {
+      lreader_newline(r, r->p);
+      r->p++;
+    } else if (lreader_chars.cls[(unsigned char)c] & LCH_SPACE) {
+      r->p++;
+    } else if (c == ';') {
+      while (r->p < r->end && *r->p != '\n' && *r->p != '\r') { r->p++; }
+    } else {
+      break;
+    }
+  }
+}
+
+lval* lreader_number(const char* s, size_t n, int floating) {
+  /* strtol and strtod want a terminated string */
+  char buf[64];
+  std::string big;
+  const char* t = buf;
+  if (n < sizeof(buf)) {
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+  } else {
+    big.assign(s, n);
+    t = big.c_str();
+  }
+  errno = 0;
+  if (floating) {
+    double x = strtod(t, NULL);
+    return errno != ERANGE ? lval_floating(x) : lval_err("Invalid number");
+  }
+  long x = strtol(t, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+}
+
+lval* lreader_string(lreader* r) {
+  const char* q = r->p + 1;
+  while (q < r->end && *q != '"') {
+    if (*q == '\\' && q + 1 < r->end) { q++; }
+    if (*q == '\n') { lreader_newline(r, q); }
+    q++;
+  }
+  if (q == r->end) {
+    r->p = q;
+    return lreader_error(r, "'\"'");
+  }
+  size_t n = q - (r->p + 1);
+  char* raw = (char*)malloc(n + 1);
+  memcpy(raw, r->p + 1, n);
+  raw[n] = '\0';
+  r->p = q + 1;
+  lval* v = (lval*)malloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->str = (char*)mpcf_unescape(raw);
+  return v;
+}
+
+lval* lreader_form(lreader* r);
+
+lval* lreader_list(lreader* r, char close) {
+  lval* x = close == ')' ? lval_sexpr() : lval_qexpr();
+  r->p++;
+  lreader_skip(r);
+  while (r->p == r->end || *r->p != close) {
+    lval* y = lreader_form(r);
+    if (!y) {
+      lval_del(x);
+      if (!r->err) {
+        lreader_error(r, close == ')' ? "expression or ')'" : "expression or '}'");
+      }
+      return NULL;
+    }
+    lval_add(x, y);
+    lreader_skip(r);
+  }
+  r->p++;
+  return x;
+}
+
+/* Reads the expression starting at r->p. Returns NULL, leaving r->err
+   unset, if none starts there. */
+lval* lreader_form(lreader* r) {
+  const char* s = r->p;
+  const char* q = s < r->end && *s == '-' ? s + 1 : s;
+  const char* d = q;
+
+  /* Floating or number */
+  while (lreader_is(r, d, LCH_DIGIT)) { d++; }
+  if (d == q && d < r->end && *d == '.' && lreader_is(r, d + 1, LCH_DIGIT)) {
+    d++;
+    while (lreader_is(r, d, LCH_DIGIT)) { d++; }
+    r->p = d;
+    return lreader_number(s, d - s, 1);
+  }
+  if (d > q) {
+    int floating = d < r->end && *d == '.';
+    if (floating) {
+      d++;
+      while (lreader_is(r, d, LCH_DIGIT)) { d++; }
+    }
+    r->p = d;
+    return lreader_number(s, d - s, floating);
+  }
+
+  /* Symbol */
+  if (lreader_is(r, s, LCH_SYMBOL)) {
+    d = s + 1;
+    while (lreader_is(r, d, LCH_SYMBOL)) { d++; }
+    lval* v = (lval*)malloc(sizeof(lval));
+    v->type = LVAL_SYM;
+    v->sym = (char*)malloc(d - s + 1);
+    memcpy(v->sym, s, d - s);
+    v->sym[d - s] = '\0';
+    r->p = d;
+    return v;
+  }
+
+  if (s == r->end) { return NULL; }
+  switch (*s) {
+    case '"': return lreader_string(r);
+    case '(': return lreader_list(r, ')');
+    case '{': return lreader_list(r, '}');
+    default: return NULL;
+  }
+}
+
+/* Reads all the expressions in data into an S-Expression, as lval_read
+   does from an mpc AST, or returns the syntax error */
+lval* lread(const char* name, const char* data, size_t size) {
+  lreader r;
+  lreader_init(&r, name, data, size);
+  lval* x = lval_sexpr();
+  lreader_skip(&r);
+  while (r.p < r.end) {
+    lval* y = lreader_form(&r);
+    if (!y) {
+      lval_del(x);
+      if (!r.err) { lreader_error(&r, "expression or end of input"); }
+      return r.err;
+    }
+    lval_add(x, y);
+    lreader_skip(&r);
+  }
+  return x;
+}
+
 lval* lval_pop(lval* v, int i) {
   /* Find the item at "i" */
   lval* x = v->cell[i];
@@ -557,13 +1149,48 @@ lval* lval_copy(lval* v) {
       }
     break;
 
-    // FIXME: should we do reference counting?
-    case LVAL_TOBJ: x->obj = v->obj; break;
+    /* Owned objects are shared, not cloned */
+    case LVAL_TOBJ:
+      x->obj = v->obj;
+      x->ref = v->ref;
+      if (x->ref) { x->ref->refs++; }
+    break;
+
+    case LVAL_HANDLE:
+      x->handle = v->handle;
+      x->handle->refs++;
+    break;
+
+    /* Arrays are shared, whether they own their memory or not */
+    case LVAL_ARRAY:
+      x->data = v->data;
+      x->length = v->length;
+      x->atype = v->atype;
+      x->readonly = v->readonly;
+      x->buf = v->buf;
+      if (x->buf) { x->buf->refs++; }
+      x->ref = v->ref;
+      if (x->ref) { x->ref->refs++; }
+    break;
     case LVAL_TMETHOD: 
       x->method = v->method; 
       x->methodArgs = strdup(v->methodArgs);
     break;
 
+    /* Sequences get their own iterator at the same position */
+    case LVAL_SEQ:
+      x->coll = v->coll;
+      x->obj = v->obj;
+      x->index = v->index;
+      x->iter = NULL;
+      if (v->iter) {
+        x->iter = v->coll->MakeIterator();
+        *x->iter = *v->iter;
+      }
+      x->ref = v->ref;
+      if (x->ref) { x->ref->refs++; }
+    break;
+
     case LVAL_NUM: x->num = v->num; break;
     case LVAL_FLOAT: x->floating = v->floating; break;
     
@@ -583,12 +1210,50 @@ lval* lval_copy(lval* v) {
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
       }
+      x->jump = ljump_share(v);
     break;
   }
   
   return x;
 }
 
+/* Move a sequence to its next element. TObjArrays are walked by index,
+   everything else through a TIterator. Empty slots are skipped like
+   TIter does. */
+void lval_seq_next(lval* s) {
+  if (s->iter) {
+    s->obj = s->iter->Next();
+    return;
+  }
+  TObjArray* array = (TObjArray*)s->coll;
+  s->obj = NULL;
+  while (!s->obj && ++s->index < array->GetEntriesFast()) {
+    s->obj = array->UncheckedAt(s->index);
+  }
+}
+
+/* A lazy sequence over the elements of a collection. Nothing is copied:
+   elements are wrapped one at a time as they are reached. */
+lval* lval_seq(TCollection* coll, lobj* owner) {
+  lval* v = (lval*)malloc(sizeof(lval));
+  v->type = LVAL_SEQ;
+  v->coll = coll;
+  v->iter = NULL;
+  v->index = -1;
+  v->ref = owner;
+  if (owner) { owner->refs++; }
+  if (!coll->InheritsFrom(TObjArray::Class())) {
+    v->iter = coll->MakeIterator();
+  }
+  lval_seq_next(v);
+  return v;
+}
+
+/* The current element of a sequence, sharing its owner */
+lval* lval_seq_current(lval* s) {
+  return lval_tobj_shared(s->obj, s->ref);
+}
+
 lval* lval_call(lenv* e, lval* f, lval* a) {
 
   /* If Builtin then simply apply that */
@@ -678,11 +1343,32 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 }
 
-// Evaluate an expression
+/* Builtins taking no arguments, which are called rather than returned
+   when they appear alone in an S-Expression, e.g. (live-objects) */
+std::set<lbuiltin> lthunks;
+
+bool lbuiltin_is_thunk(lval* f) {
+  return f->type == LVAL_FUN && f->builtin && lthunks.count(f->builtin);
+}
+
+/* Builtins receiving their arguments unevaluated, which they evaluate
+   themselves if and when needed, e.g. (or x (expensive)) */
+std::set<lbuiltin> lspecials;
+
+bool lbuiltin_is_special(lval* f) {
+  return f->type == LVAL_FUN && f->builtin && lspecials.count(f->builtin);
+}
+
 lval* lval_eval_sexpr(lenv* e, lval* v) {
 
   for (int i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
+    if (i == 0 && v->count > 1 && lbuiltin_is_special(v->cell[0])) {
+      lval* f = lval_pop(v, 0);
+      lval* result = f->builtin(e, v);
+      lval_del(f);
+      return result;
+    }
   }
   
   for (int i = 0; i < v->count; i++) {
@@ -690,6 +1376,12 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   }
 
   if (v->count == 0) { return v; }  
+  if (v->count == 1 && lbuiltin_is_thunk(v->cell[0])) {
+    lval* f = lval_pop(v, 0);
+    lval* result = lval_call(e, f, v);
+    lval_del(f);
+    return result;
+  }
   if (v->count == 1) { return lval_take(v, 0); }
 
   /* Ensure first element is a function after evaluation */
@@ -729,9 +1421,21 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
             ltype_name(a->cell[0]->type),                           \
             ltype_name(expected));
 
+#define LASSERT_ALIVE(what, a, n)                                   \
+    LASSERT(a, !lval_deleted(a->cell[n]),                           \
+            "Function '%s' passed an object that was deleted by ROOT.", what);
+
 lval* builtin_head(lenv *e, lval* a) {
   /* Check Error Conditions */
   LASSERT_NUM("head", a, 1);
+
+  /* Head of a sequence is a list with its current element */
+  if (a->cell[0]->type == LVAL_SEQ) {
+    LASSERT(a, a->cell[0]->obj, "Function 'head' passed {}!");
+    lval* x = lval_add(lval_qexpr(), lval_seq_current(a->cell[0]));
+    lval_del(a);
+    return x;
+  }
   LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
   LASSERT(a, a->cell[0]->count != 0,
     "Function 'head' passed {}!");
@@ -747,6 +1451,14 @@ lval* builtin_head(lenv *e, lval* a) {
 lval* builtin_tail(lenv *e, lval* a) {
   /* Check Error Conditions */
   LASSERT_NUM("tail", a, 1);
+
+  /* Tail of a sequence is the same sequence one element further */
+  if (a->cell[0]->type == LVAL_SEQ) {
+    LASSERT(a, a->cell[0]->obj, "Function 'tail' passed {}!");
+    lval* x = lval_take(a, 0);
+    lval_seq_next(x);
+    return x;
+  }
   LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
   LASSERT(a, a->cell[0]->count != 0,
     "Function 'tail' passed {}!");
@@ -802,6 +1514,220 @@ lval* builtin_join(lenv *e, lval* a) {
   return x;
 }
 
+#define LASSERT_NUMERIC(what, a, n)                                 \
+    LASSERT(a, a->cell[n]->type == LVAL_NUM                         \
+               || a->cell[n]->type == LVAL_FLOAT,                   \
+            "Function '%s' passed incorrect type for argument %i. " \
+            "Got %s, expected %s.", what, n,                        \
+            ltype_name(a->cell[n]->type),                           \
+            ltype_name(LVAL_FLOAT));
+
+/* Numeric conversions used when calling C++ directly */
+double lval_to_double(lval* v) {
+  return v->type == LVAL_FLOAT ? v->floating : (double)v->num;
+}
+
+long lval_to_long(lval* v) {
+  return v->type == LVAL_NUM ? v->num : (long)v->floating;
+}
+
+/* An object read from dir, see dirobject in NativeBindings.list. The
+   directory keeps what it holds in memory, including the histograms and
+   trees it attaches when reading them: those are borrowed, anything else
+   was read for us alone and is owned. */
+lval* lval_tobj_read(TDirectory* dir, TObject* obj) {
+  if (!obj) { return lval_tobj(obj); }
+  TDirectory* held = NULL;
+  if (obj->InheritsFrom(TH1::Class())) { held = ((TH1*)obj)->GetDirectory(); }
+  if (obj->InheritsFrom(TTree::Class())) { held = ((TTree*)obj)->GetDirectory(); }
+  if (held || (dir->GetList() && dir->GetList()->FindObject(obj))) { return lval_tobj(obj); }
+  return lval_tobj_owned(obj);
+}
+
+/* A method compiled in via NativeBindings.list. It receives the object
+   and the remaining arguments, and owns the latter like a builtin does. */
+typedef lval*(*lnative)(TObject*, lval*);
+
+struct lnative_binding {
+  const char* klass;
+  const char* method;
+  int nargs;
+  lnative func;
+};
+
+#include "NativeBindings.h"
+
+/* Find the native binding for a method of a given class, if any. Lookups
+   (including misses) are remembered in a small direct-mapped cache per
+   thread, so that a call from a loop costs the IsA() call, a hash of the
+   method name and a comparison, with no allocation and no lock. */
+struct lnative_slot {
+  TClass* klass;
+  int nargs;
+  std::string method;
+  lnative func;
+};
+
+enum { LNATIVE_SLOTS = 256 };
+
+lnative lnative_find(TObject* obj, const char* method, int nargs) {
+  static thread_local lnative_slot cache[LNATIVE_SLOTS];
+
+  TClass* klass = obj->IsA();
+  size_t h = (size_t)klass / sizeof(void*) + nargs;
+  for (const char* c = method; *c; c++) { h = h * 31 + (unsigned char)*c; }
+  lnative_slot& slot = cache[h % LNATIVE_SLOTS];
+  if (slot.klass == klass && slot.nargs == nargs
+      && strcmp(slot.method.c_str(), method) == 0) { return slot.func; }
+
+  /* Misses resolve class names through ROOT, which is not thread safe */
+  std::lock_guard<std::mutex> lock(lglobal_mutex);
+  lnative func = NULL;
+  for (lnative_binding* b = lnative_bindings; b->klass; b++) {
+    if (b->nargs == nargs && strcmp(b->method, method) == 0
+        && obj->InheritsFrom(b->klass)) {
+      func = b->func;
+      break;
+    }
+  }
+  slot.klass = klass;
+  slot.nargs = nargs;
+  slot.method = method;
+  slot.func = func;
+  return func;
+}
+
+/* Helpers for the list functions below, which work on both Q-Expressions
+   and sequences. They loop rather than recurse, so they can walk very
+   long collections without growing the stack. */
+#define LASSERT_LIST(what, a, n)                                    \
+    LASSERT(a, a->cell[n]->type == LVAL_QEXPR                       \
+               || a->cell[n]->type == LVAL_SEQ,                     \
+            "Function '%s' passed incorrect type for argument %i. " \
+            "Got %s, expected %s.", what, n,                        \
+            ltype_name(a->cell[n]->type),                           \
+            ltype_name(LVAL_QEXPR));
+
+/* Call f, which is left untouched, with a single argument or two */
+lval* lval_apply(lenv* e, lval* f, lval* x, lval* y) {
+  lval* args = lval_add(lval_sexpr(), x);
+  if (y) { lval_add(args, y); }
+  if (f->builtin) { return f->builtin(e, args); }
+  lval* fc = lval_copy(f);
+  lval* r = lval_call(e, fc, args);
+  lval_del(fc);
+  return r;
+}
+
+/* Element i of a list as the standard library's 'fst' would see it */
+lval* lval_list_item(lenv* e, lval* l, int i) {
+  return lval_eval(e, lval_add(lval_sexpr(), lval_copy(l->cell[i])));
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_SEQ
+             || a->cell[0]->type == LVAL_ARRAY,
+    "Function 'len' passed incorrect type. Got %s.",
+    ltype_name(a->cell[0]->type));
+  lval* l = a->cell[0];
+  long n = 0;
+  if (l->type == LVAL_ARRAY) {
+    n = l->length;
+  } else if (l->type == LVAL_QEXPR) {
+    n = l->count;
+  } else {
+    for (; l->obj; lval_seq_next(l)) { n++; }
+  }
+  lval_del(a);
+  return lval_num(n);
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_LIST("map", a, 1);
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  lval* x = lval_qexpr();
+  for (int i = 0; l->type == LVAL_QEXPR ? i < l->count : l->obj != NULL; i++) {
+    lval* item = l->type == LVAL_QEXPR ? lval_list_item(e, l, i)
+                                       : lval_seq_current(l);
+    lval* r = lval_apply(e, f, item, NULL);
+    if (r->type == LVAL_ERR) { lval_del(x); lval_del(a); return r; }
+    lval_add(x, r);
+    if (l->type == LVAL_SEQ) { lval_seq_next(l); }
+  }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_LIST("filter", a, 1);
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  lval* x = lval_qexpr();
+  for (int i = 0; l->type == LVAL_QEXPR ? i < l->count : l->obj != NULL; i++) {
+    lval* item = l->type == LVAL_QEXPR ? lval_list_item(e, l, i)
+                                       : lval_seq_current(l);
+    lval* r = lval_apply(e, f, item, NULL);
+    if (r->type == LVAL_ERR) { lval_del(x); lval_del(a); return r; }
+    if (r->type != LVAL_NUM) {
+      lval* err = lval_err("Function 'filter' predicate returned %s, expected %s.",
+        ltype_name(r->type), ltype_name(LVAL_NUM));
+      lval_del(r); lval_del(x); lval_del(a);
+      return err;
+    }
+    if (r->num) {
+      lval_add(x, l->type == LVAL_QEXPR ? lval_copy(l->cell[i])
+                                        : lval_seq_current(l));
+    }
+    lval_del(r);
+    if (l->type == LVAL_SEQ) { lval_seq_next(l); }
+  }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  LASSERT_LIST("foldl", a, 2);
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+  lval* z = lval_pop(a, 1);
+  for (int i = 0; l->type == LVAL_QEXPR ? i < l->count : l->obj != NULL; i++) {
+    lval* item = l->type == LVAL_QEXPR ? lval_list_item(e, l, i)
+                                       : lval_seq_current(l);
+    z = lval_apply(e, f, z, item);
+    if (z->type == LVAL_ERR) { break; }
+    if (l->type == LVAL_SEQ) { lval_seq_next(l); }
+  }
+  lval_del(a);
+  return z;
+}
+
+// Turns a collection into a lazy sequence usable with the list functions.
+// A directory (or file) gives the sequence of its keys.
+lval* builtin_seq(lenv* e, lval* a) {
+  LASSERT_NUM("seq", a, 1);
+  LASSERT_TYPE("seq", a, 0, LVAL_TOBJ);
+  LASSERT_ALIVE("seq", a, 0);
+  TObject* obj = a->cell[0]->obj;
+  TCollection* coll = NULL;
+  if (obj && obj->InheritsFrom(TCollection::Class())) {
+    coll = (TCollection*)obj;
+  } else if (obj && obj->InheritsFrom(TDirectory::Class())) {
+    coll = ((TDirectory*)obj)->GetListOfKeys();
+  }
+  LASSERT(a, coll, "Function 'seq' needs a collection or a directory.");
+  lval* x = lval_seq(coll, a->cell[0]->ref);
+  lval_del(a);
+  return x;
+}
+
 // Built-in method to get a member (either data or method) of a given object.
 // - The first argument must be a string.
 // - The second argument must be an object.
@@ -813,18 +1739,34 @@ lval* builtin_member(lenv *e, lval *a) {
     "Function '.' needs at least 2 argument: <method name> and <object>.");
   LASSERT_TYPE(".", a, 0, LVAL_STR);
   LASSERT_TYPE(".", a, 1, LVAL_TOBJ);
+  LASSERT_ALIVE(".", a, 1);
+  LASSERT(a, a->cell[1]->obj, "Function '.' passed a null object.");
   /* Pop the first element */
   lval* name = lval_pop(a, 0);
   lval* obj = lval_pop(a, 0);
-  lval_print(name);
-  lval_print(obj);
+  lredraw_touch_value(obj);
+
+  /* Use the generated direct call when there is one */
+  lnative native = obj->obj ? lnative_find(obj->obj, name->str, a->count) : NULL;
+  if (native) {
+    lval* x = native(obj->obj, a);
+    /* A borrowed object returned by a member, e.g. an axis or a fitted
+       function, usually lives in the receiver: keep the receiver alive,
+       and redraw it when the part is changed */
+    if (x->type == LVAL_TOBJ && x->obj && !x->ref && obj->ref) {
+      x->ref = obj->ref;
+      x->ref->refs++;
+    }
+    lval_del(name); lval_del(obj);
+    return x;
+  }
+
+  lroot_init();
   std::string args = lval_to_cpp_arg(a, 0);
-  std::cout << "Executing " << name->str << "(" << args.c_str() 
-                                     << ") in object " << std::hex << obj->obj
-                                     << " of class " << obj->obj->ClassName() << std::endl;
   // FIXME: Slow and error prone, but good enough for now
   int error = 0;
   obj->obj->Execute(name->str, args.c_str(), &error);
+  lval_del(name); lval_del(obj); lval_del(a);
   return lval_qexpr();
 }
 
@@ -1015,31 +1957,199 @@ lval* builtin_if(lenv* e, lval* a) {
   return x;
 }
 
+/* 'and' and 'or' receive their arguments unevaluated, and only evaluate
+   them until the result is known */
+lval* builtin_logic(lenv* e, lval* a, const char* op) {
+  int decisive = strcmp(op, "or") == 0;
+  for (int i = 0; i < a->count; i++) {
+    a->cell[i] = lval_eval(e, a->cell[i]);
+    lval* x = a->cell[i];
+    if (x->type == LVAL_ERR) { return lval_take(a, i); }
+    LASSERT(a, x->type == LVAL_NUM || x->type == LVAL_FLOAT,
+            "Function '%s' passed incorrect type for argument %i. "
+            "Got %s, expected %s.", op, i,
+            ltype_name(x->type), ltype_name(LVAL_NUM));
+    int truth = x->type == LVAL_NUM ? x->num != 0 : x->floating != 0;
+    if (truth == decisive) {
+      lval_del(a);
+      return lval_num(decisive);
+    }
+  }
+  lval_del(a);
+  return lval_num(!decisive);
+}
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+lval* builtin_and(lenv* e, lval* a) {
+  return builtin_logic(e, a, "and");
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+lval* builtin_or(lenv* e, lval* a) {
+  return builtin_logic(e, a, "or");
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+/* Evaluate the (unevaluated) arguments in sequence and return the last */
+lval* builtin_do(lenv* e, lval* a) {
+  if (a->count == 0) {
+    lval_del(a);
+    return lval_qexpr();
+  }
+  for (int i = 0; i < a->count - 1; i++) {
+    a->cell[i] = lval_eval(e, a->cell[i]);
+    if (a->cell[i]->type == LVAL_ERR) { return lval_take(a, i); }
+  }
+  return lval_eval(e, lval_take(a, a->count - 1));
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+/* Evaluate a body in a new scope, so that '=' does not leak out of it */
+lval* builtin_let(lenv* e, lval* a) {
+  LASSERT_NUM("let", a, 1);
+  LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+  lenv* scope = lenv_new();
+  scope->par = e;
+  lval* x = builtin_eval(scope, a);
+  lenv_del(scope);
+  return x;
 }
 
-lval* builtin_var(lenv* e, lval* a, const char* func) {
-  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-  
-  lval* syms = a->cell[0];
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-      "Function '%s' cannot define non-symbol. "
-      "Got %s, Expected %s.", func, 
+/* Clauses of 'select' and 'case' are lists of a condition, or constant,
+   and the expression to evaluate when it holds */
+lval* lval_check_clause(lval* a, int i, const char* op) {
+  lval* c = a->cell[i];
+  if (c->type != LVAL_QEXPR || c->count < 2) {
+    return lval_err("Function '%s' passed incorrect clause %i. "
+                    "Expected a list of two items.", op, i);
+  }
+  return NULL;
+}
+
+lval* builtin_select(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    lval* err = lval_check_clause(a, i, "select");
+    if (err) { lval_del(a); return err; }
+    lval* cond = lval_list_item(e, a->cell[i], 0);
+    if (cond->type == LVAL_ERR) { lval_del(a); return cond; }
+    if (cond->type != LVAL_NUM) {
+      lval* err = lval_err("Function 'select' passed incorrect condition %i. "
+                           "Got %s, expected %s.", i,
+                           ltype_name(cond->type), ltype_name(LVAL_NUM));
+      lval_del(cond); lval_del(a);
+      return err;
+    }
+    long truth = cond->num;
+    lval_del(cond);
+    if (truth) {
+      lval* x = lval_list_item(e, a->cell[i], 1);
+      lval_del(a);
+      return x;
+    }
+  }
+  lval_del(a);
+  return lval_err("No Selection Found");
+}
+
+/* Case forms that went through a jump table and those that compared x
+   with each constant, see case-stats */
+std::atomic<long> lcase_jumps(0);
+std::atomic<long> lcase_scans(0);
+
+/* The clause of a case form matching x through its jump table, -1 if
+   none matches, or 0 if the table cannot tell */
+int lcase_jump(lval* a, lval* x) {
+  ljump* j = a->jump;
+  if (!j || j->count != a->count) { return 0; }
+  std::call_once(j->filled, ljump_fill, j, a);
+  if (!j->usable) { return 0; }
+  std::unordered_map<long, int>::const_iterator n;
+  switch (x->type) {
+    case LVAL_NUM:
+      n = j->nums.find(x->num);
+      return n == j->nums.end() ? -1 : n->second;
+    case LVAL_FLOAT:
+      /* Integer constants are compared as floats, as with '==' */
+      if (!(x->floating > -9e18 && x->floating < 9e18)
+          || x->floating != (double)(long)x->floating) { return -1; }
+      n = j->nums.find((long)x->floating);
+      return n == j->nums.end() ? -1 : n->second;
+    case LVAL_STR: {
+      std::unordered_map<std::string, int>::const_iterator s =
+        j->strs.find(x->str);
+      return s == j->strs.end() ? -1 : s->second;
+    }
+    default:
+      return -1;
+  }
+}
+
+lval* builtin_case(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1,
+          "Function 'case' passed too few arguments. "
+          "Got %i, expected at least %i.", a->count, 1);
+
+  int k = lcase_jump(a, a->cell[0]);
+  if (k != 0) {
+    lcase_jumps++;
+  } else {
+    /* Compare with each constant in turn, as '==' would */
+    lcase_scans++;
+    k = -1;
+    for (int i = 1; i < a->count && k < 0; i++) {
+      lval* err = lval_check_clause(a, i, "case");
+      if (err) { lval_del(a); return err; }
+      lval* c = lval_list_item(e, a->cell[i], 0);
+      if (c->type == LVAL_ERR) { lval_del(a); return c; }
+      lval* x = lval_copy(a->cell[0]);
+      best_numeric_type(x, c);
+      if (lval_eq(x, c)) { k = i; }
+      lval_del(x); lval_del(c);
+    }
+  }
+  if (k < 0) {
+    lval_del(a);
+    return lval_err("No Case Found");
+  }
+  lval* err = lval_check_clause(a, k, "case");
+  if (err) { lval_del(a); return err; }
+  lval* x = lval_list_item(e, a->cell[k], 1);
+  lval_del(a);
+  return x;
+}
+
+// Returns {jumps scans}: how many case forms went through a jump table and
+// how many compared their value with each constant in turn.
+lval* builtin_case_stats(lenv* e, lval* a) {
+  LASSERT_NUM("case-stats", a, 0);
+  lval_del(a);
+  lval* x = lval_qexpr();
+  lval_add(x, lval_num(lcase_jumps));
+  lval_add(x, lval_num(lcase_scans));
+  return x;
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+  return builtin_op(e, a, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+  return builtin_op(e, a, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+  return builtin_op(e, a, "*");
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  return builtin_op(e, a, "/");
+}
+
+lval* builtin_var(lenv* e, lval* a, const char* func) {
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  
+  lval* syms = a->cell[0];
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+      "Function '%s' cannot define non-symbol. "
+      "Got %s, Expected %s.", func, 
       ltype_name(syms->cell[i]->type),
       ltype_name(LVAL_SYM));
   }
@@ -1063,201 +2173,3583 @@ lval* builtin_var(lenv* e, lval* a, const char* func) {
   return lval_sexpr();
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-  return builtin_var(e, a, "def");
+lval* builtin_def(lenv* e, lval* a) {
+  return builtin_var(e, a, "def");
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+  return builtin_var(e, a, "=");
+}
+
+int lval_eq(lval* x, lval* y) {
+
+  /* An exhausted sequence is the same as the empty list */
+  if (x->type == LVAL_SEQ && y->type == LVAL_QEXPR) {
+    return !x->obj && y->count == 0;
+  }
+  if (x->type == LVAL_QEXPR && y->type == LVAL_SEQ) {
+    return !y->obj && x->count == 0;
+  }
+
+  /* Different Types are always unequal */
+  if (x->type != y->type) { return 0; }
+
+  /* Compare Based upon type */
+  switch (x->type) {
+    /* Compare Number Value */
+    case LVAL_NUM: return (x->num == y->num);
+    case LVAL_FLOAT: return (x->floating == y->floating);
+
+    /* Compare String Values */
+    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
+    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+
+    /* If builtin compare, otherwise compare formals and body */
+    case LVAL_FUN:
+      if (x->builtin || y->builtin) {
+        return x->builtin == y->builtin;
+      } else {
+        return lval_eq(x->formals, y->formals) 
+          && lval_eq(x->body, y->body);
+      }
+    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    case LVAL_TOBJ: return x->obj == y->obj;
+    case LVAL_SEQ: return x->coll == y->coll && x->obj == y->obj;
+    case LVAL_ARRAY: return x->data == y->data && x->length == y->length;
+    case LVAL_HANDLE: return x->handle == y->handle;
+
+    /* If list compare every individual element */
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (x->count != y->count) { return 0; }
+      for (int i = 0; i < x->count; i++) {
+        /* If any element not equal then whole list not equal */
+        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+      }
+      /* Otherwise lists must be equal */
+      return 1;
+    break;
+  }
+  return 0;
+}
+
+
+
+lval* builtin_lambda(lenv* e, lval* a) {
+  /* Check Two arguments, each of which are Q-Expressions */
+  LASSERT_NUM("\\", a, 2);
+  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+  
+  /* Check first Q-Expression contains only Symbols */
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+      "Cannot define non-symbol. Got %s, Expected %s.",
+      ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+  }
+  
+  /* Pop first two arguments and pass them to lval_lambda */
+  lval* formals = lval_pop(a, 0);
+  lval* body = lval_pop(a, 0);
+  lval_del(a);
+  
+  return lval_lambda(formals, body);
+}
+
+/* Builtins by name, so that images can refer to them, see limage_put */
+std::map<std::string, lbuiltin> lbuiltin_names;
+
+void lenv_add_builtin(lenv* e, const char* name, lbuiltin func) {
+  lbuiltin_names[name] = func;
+  lval* k = lval_sym(name);
+  lval* v = lval_fun(func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+void lenv_add_thunk(lenv* e, const char* name, lbuiltin func) {
+  lthunks.insert(func);
+  lenv_add_builtin(e, name, func);
+}
+
+void lenv_add_special(lenv* e, const char* name, lbuiltin func) {
+  lspecials.insert(func);
+  lenv_add_builtin(e, name, func);
+}
+
+void lenv_add_global_object(lenv* e, const char* name, TObject *obj) {
+  lval* k = lval_sym(name);
+  lval* v = lval_tobj(obj);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+double lclock() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Startup timing, see builtin_startup_time. ROOT and its interpreter are
+   only set up by the first builtin which needs them, so that scripts
+   which never touch a ROOT object do not pay for it. */
+struct lstartup {
+  double start;     /* when main started */
+  double ready;     /* when the first expression could be evaluated */
+  double root;      /* time spent setting up ROOT, if it was */
+};
+
+lstartup lstartup_times = { 0., 0., -1. };
+
+/* What lroot_init sets up, filled in by main: batch mode, or the
+   interactive application with its arguments and environment */
+struct lroot_setup {
+  bool batch;
+  int* argc;
+  char** argv;
+  lenv* env;        /* creates the ROOTureApp when not NULL */
+};
+
+lroot_setup lroot_args = { false, NULL, NULL, NULL };
+
+void lroot_init() {
+  if (lstartup_times.root >= 0) { return; }
+  double start = lclock();
+  if (lroot_args.batch) { gROOT->SetBatch(kTRUE); }
+  if (lroot_args.env && !gApplication) {
+    new ROOTureApp(lroot_args.argc, lroot_args.argv, lroot_args.env);
+  }
+  TInterpreter::Instance();
+  lstartup_times.root = lclock() - start;
+}
+
+/* ROOT globals are looked up when used rather than bound at startup, which
+   also means they always refer to the current pad, file or directory. */
+TObject* lglobal_gSystem() { return gSystem; }
+TObject* lglobal_gInterpreter() { return gInterpreter; }
+TObject* lglobal_gROOT() { return gROOT; }
+TObject* lglobal_gFile() { return gFile; }
+TObject* lglobal_gPad() { return gPad; }
+TObject* lglobal_gDirectory() { return gDirectory; }
+TObject* lglobal_gRandom() { return gRandom; }
+
+struct lglobal {
+  const char* name;
+  TObject* (*get)();
+};
+
+lglobal lglobals[] = {
+  { "gSystem", lglobal_gSystem },
+  { "gInterpreter", lglobal_gInterpreter },
+  { "gROOT", lglobal_gROOT },
+  { "gFile", lglobal_gFile },
+  { "gPad", lglobal_gPad },
+  { "gDirectory", lglobal_gDirectory },
+  { "gRandom", lglobal_gRandom },
+  { NULL, NULL }
+};
+
+lval* lglobal_lookup(const char* name) {
+  if (name[0] != 'g') { return NULL; }
+  for (lglobal* g = lglobals; g->name; g++) {
+    if (strcmp(g->name, name) == 0) {
+      if (lworker) {
+        return lval_err("ROOT global %s cannot be used by a tree-fold "
+                        "function.", name);
+      }
+      lroot_init();
+      return lval_tobj(g->get());
+    }
+  }
+  return NULL;
+}
+
+// Returns {ready-seconds root-seconds}: the time from the start of the
+// program until it could evaluate, and the time spent setting up ROOT
+// (-1 if nothing needed it yet).
+lval* builtin_startup_time(lenv* e, lval* a) {
+  LASSERT_NUM("startup-time", a, 0);
+  lval_del(a);
+  lval* x = lval_qexpr();
+  lval_add(x, lval_floating(lstartup_times.ready - lstartup_times.start));
+  lval_add(x, lval_floating(lstartup_times.root));
+  return x;
+}
+
+/* Images are values serialized to bytes, so that they can be read back
+   without parsing or evaluating anything. Only data and functions can be
+   written: numbers, strings, symbols, expressions, builtins (by name) and
+   lambdas, along with their partially applied arguments. */
+void limage_put_long(std::string& out, unsigned long long x) {
+  for (int i = 0; i < 8; i++) { out += (char)((x >> (8 * i)) & 0xff); }
+}
+
+void limage_put_str(std::string& out, const char* s) {
+  size_t n = strlen(s);
+  limage_put_long(out, n);
+  out.append(s, n);
+}
+
+bool limage_put(std::string& out, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM:
+      out += 'n';
+      limage_put_long(out, (unsigned long long)v->num);
+      return true;
+    case LVAL_FLOAT: {
+      unsigned long long x;
+      memcpy(&x, &v->floating, sizeof(x));
+      out += 'f';
+      limage_put_long(out, x);
+      return true;
+    }
+    case LVAL_SYM: out += 's'; limage_put_str(out, v->sym); return true;
+    case LVAL_STR: out += 't'; limage_put_str(out, v->str); return true;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      out += v->type == LVAL_SEXPR ? '(' : '{';
+      limage_put_long(out, v->count);
+      for (int i = 0; i < v->count; i++) {
+        if (!limage_put(out, v->cell[i])) { return false; }
+      }
+      return true;
+    case LVAL_FUN:
+      if (v->builtin) {
+        std::map<std::string, lbuiltin>::iterator it;
+        for (it = lbuiltin_names.begin(); it != lbuiltin_names.end(); ++it) {
+          if (it->second == v->builtin) {
+            out += 'b';
+            limage_put_str(out, it->first.c_str());
+            return true;
+          }
+        }
+        return false;
+      }
+      out += 'l';
+      if (!limage_put(out, v->formals) || !limage_put(out, v->body)) {
+        return false;
+      }
+      limage_put_long(out, v->env->count);
+      for (int i = 0; i < v->env->count; i++) {
+        limage_put_str(out, v->env->syms[i]);
+        if (!limage_put(out, v->env->vals[i])) { return false; }
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool limage_get_long(const unsigned char*& p, const unsigned char* end,
+                     unsigned long long& x) {
+  if (end - p < 8) { return false; }
+  x = 0;
+  for (int i = 0; i < 8; i++) { x |= (unsigned long long)p[i] << (8 * i); }
+  p += 8;
+  return true;
+}
+
+bool limage_get_str(const unsigned char*& p, const unsigned char* end,
+                    std::string& s) {
+  unsigned long long n;
+  if (!limage_get_long(p, end, n) || (unsigned long long)(end - p) < n) {
+    return false;
+  }
+  s.assign((const char*)p, n);
+  p += n;
+  return true;
+}
+
+/* Returns NULL if the image is truncated or corrupted */
+lval* limage_get(const unsigned char*& p, const unsigned char* end) {
+  if (p == end) { return NULL; }
+  char tag = *p++;
+  unsigned long long x;
+  std::string s;
+  switch (tag) {
+    case 'n':
+      if (!limage_get_long(p, end, x)) { return NULL; }
+      return lval_num((long)x);
+    case 'f': {
+      if (!limage_get_long(p, end, x)) { return NULL; }
+      double d;
+      memcpy(&d, &x, sizeof(d));
+      return lval_floating(d);
+    }
+    case 's':
+      if (!limage_get_str(p, end, s)) { return NULL; }
+      return lval_sym(s.c_str());
+    case 't':
+      if (!limage_get_str(p, end, s)) { return NULL; }
+      return lval_str(s.c_str());
+    case '(':
+    case '{': {
+      if (!limage_get_long(p, end, x)) { return NULL; }
+      lval* v = tag == '(' ? lval_sexpr() : lval_qexpr();
+      for (unsigned long long i = 0; i < x; i++) {
+        lval* c = limage_get(p, end);
+        if (!c) { lval_del(v); return NULL; }
+        lval_add(v, c);
+      }
+      return v;
+    }
+    case 'b': {
+      if (!limage_get_str(p, end, s)) { return NULL; }
+      std::map<std::string, lbuiltin>::iterator it = lbuiltin_names.find(s);
+      if (it == lbuiltin_names.end()) { return NULL; }
+      return lval_fun(it->second);
+    }
+    case 'l': {
+      lval* formals = limage_get(p, end);
+      if (!formals) { return NULL; }
+      lval* body = limage_get(p, end);
+      if (!body) { lval_del(formals); return NULL; }
+      lval* f = lval_lambda(formals, body);
+      if (!limage_get_long(p, end, x)) { lval_del(f); return NULL; }
+      for (unsigned long long i = 0; i < x; i++) {
+        lval* v = NULL;
+        if (!limage_get_str(p, end, s) || !(v = limage_get(p, end))) {
+          lval_del(f);
+          return NULL;
+        }
+        lval* k = lval_sym(s.c_str());
+        lenv_put(f->env, k, v);
+        lval_del(k); lval_del(v);
+      }
+      return f;
+    }
+    default:
+      return NULL;
+  }
+}
+
+/* Images start with the version which wrote them, as the encoding and the
+   builtins they refer to may change from one version to the next */
+#define LIMAGE_MAGIC "ROOTure image " ROOTURE_VERSION
+
+bool limage_write(std::string& out, lval* v) {
+  limage_put_str(out, LIMAGE_MAGIC);
+  return limage_put(out, v);
+}
+
+lval* limage_read(const unsigned char* data, size_t size) {
+  const unsigned char* p = data;
+  const unsigned char* end = data + size;
+  std::string magic;
+  if (!limage_get_str(p, end, magic) || magic != LIMAGE_MAGIC) {
+    return NULL;
+  }
+  lval* v = limage_get(p, end);
+  if (v && p != end) { lval_del(v); return NULL; }
+  return v;
+}
+
+/* FNV-1a, to recognise files whose contents are known */
+unsigned long long lhash(const char* data, size_t size) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+bool lread_stream(FILE* f, std::string& s) {
+  char buf[65536];
+  size_t n;
+  s.clear();
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { s.append(buf, n); }
+  return !ferror(f);
+}
+
+/* Contents of a file, mapped in memory when possible so that reading it
+   copies nothing, or read in one go otherwise (pipes, special files) */
+struct lsource {
+  const char* data;
+  size_t size;
+  void* map;
+  std::string copy;
+
+  lsource() : data(NULL), size(0), map(NULL) {}
+  ~lsource() { if (map) { munmap(map, size); } }
+
+private:
+  lsource(const lsource&);
+  lsource& operator=(const lsource&);
+};
+
+bool lsource_open(lsource& s, const char* name) {
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) { return false; }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+      madvise(m, st.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      s.map = m;
+      s.data = (const char*)m;
+      s.size = st.st_size;
+      return true;
+    }
+  }
+  FILE* f = fdopen(fd, "rb");
+  if (!f) { close(fd); return false; }
+  bool ok = lread_stream(f, s.copy);
+  fclose(f);
+  s.data = s.copy.data();
+  s.size = s.copy.size();
+  return ok;
+}
+
+/* The standard library, evaluated at build time by a first build of
+   ROOTure (see lstdlib_image_write) and embedded as an image of the
+   definitions it makes. Loading a file with the same contents as the
+   stdlib.rut it was built from installs the image instead. */
+#ifdef ROOTURE_STDLIB_IMAGE
+#include "StdlibImage.h"
+#endif
+
+lval* lstdlib_image_install(lenv* e, const unsigned char* data, size_t size) {
+  lval* defs = limage_read(data, size);
+  if (!defs) { return lval_err("Corrupted standard library image"); }
+  for (int i = 0; i < defs->count; i++) {
+    lenv_def(e, defs->cell[i]->cell[0], defs->cell[i]->cell[1]);
+  }
+  lval_del(defs);
+  return lval_sexpr();
+}
+
+/* Number of top level expressions which failed in loaded files, for the
+   exit status of batch mode */
+long lload_errors = 0;
+
+/* Parsed forms of loaded files are cached on disk as images named after
+   the hash and size of the file contents, in $ROOTURE_CACHE, or
+   $XDG_CACHE_HOME/rooture, or ~/.cache/rooture. Images carry the version
+   which wrote them, so entries written by another version are ignored and
+   replaced. Setting ROOTURE_CACHE to an empty string disables the cache.
+   Batch runs, often on shared or read-only machines, only use the cache
+   when ROOTURE_CACHE is set, and a default directory whose parent is not
+   writable is skipped for the next one. */
+std::string lcache_path(unsigned long long hash, size_t size) {
+  std::string dir;
+  const char* d = getenv("ROOTURE_CACHE");
+  const char* x = getenv("XDG_CACHE_HOME");
+  const char* h = getenv("HOME");
+  if (d) {
+    dir = d;
+  } else if (lroot_args.batch) {
+    return dir;
+  } else if (x && *x && access(x, W_OK) == 0) {
+    dir = std::string(x) + "/rooture";
+  } else if (h && *h && access(h, W_OK) == 0) {
+    dir = std::string(h) + "/.cache/rooture";
+  }
+  if (dir.empty()) { return dir; }
+
+  char key[64];
+  snprintf(key, sizeof(key), "/%016llx-%lx.ruc", hash, (unsigned long)size);
+  return dir + key;
+}
+
+/* Bytes of entries kept in the cache directory. Past that, the entries
+   used least recently are removed, the modification time of an entry
+   being updated on every hit. */
+#define LCACHE_DIR_BYTES (64L << 20)
+
+lval* lcache_get(const std::string& path) {
+  lsource image;
+  if (path.empty() || !lsource_open(image, path.c_str())) { return NULL; }
+  utime(path.c_str(), NULL);
+  return limage_read((const unsigned char*)image.data, image.size);
+}
+
+/* Removes the least recently used entries of dir until they fit in
+   three quarters of LCACHE_DIR_BYTES */
+void lcache_evict(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) { return; }
+  std::vector<std::pair<time_t, std::pair<long, std::string> > > entries;
+  long total = 0;
+  for (struct dirent* de = readdir(d); de; de = readdir(d)) {
+    size_t len = strlen(de->d_name);
+    if (len < 4 || strcmp(de->d_name + len - 4, ".ruc") != 0) { continue; }
+    std::string path = dir + "/" + de->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) { continue; }
+    entries.push_back(std::make_pair(st.st_mtime, std::make_pair((long)st.st_size, path)));
+    total += st.st_size;
+  }
+  closedir(d);
+  if (total <= LCACHE_DIR_BYTES) { return; }
+
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < entries.size() && total > LCACHE_DIR_BYTES / 4 * 3; i++) {
+    if (remove(entries[i].second.second.c_str()) == 0) { total -= entries[i].second.first; }
+  }
+}
+
+/* Failures are ignored, the cache only saves time */
+void lcache_put(const std::string& path, lval* expr) {
+  std::string image;
+  if (path.empty() || !limage_write(image, expr)) { return; }
+
+  /* Create the directory, and its parent, if needed */
+  std::string dir = path.substr(0, path.rfind('/'));
+  size_t slash = dir.rfind('/');
+  if (slash != std::string::npos && slash > 0) {
+    mkdir(dir.substr(0, slash).c_str(), 0755);
+  }
+  mkdir(dir.c_str(), 0755);
+
+  /* Write aside and rename, so that concurrent runs never read a partial
+     entry */
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+  std::string tmp = path + suffix;
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (!f) { return; }
+  bool ok = fwrite(image.data(), 1, image.size(), f) == image.size();
+  if (fclose(f) != 0) { ok = false; }
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) { remove(tmp.c_str()); return; }
+  lcache_evict(dir);
+}
+
+/* Files larger than this are not cached, as their entry would hold all
+   their forms in memory at once */
+#define LCACHE_MAX_BYTES (8 << 20)
+
+void lval_load_form(lenv* e, lval* v) {
+  lval* x = lval_eval(e, v);
+  /* If Evaluation leads to error print it */
+  if (x->type == LVAL_ERR) { lval_println(x); lload_errors++; }
+  lval_del(x);
+}
+
+/* Pages of mapped files already read are released by blocks of this size,
+   a multiple of the page size */
+#define LSOURCE_RELEASE_BYTES (4 << 20)
+
+/* Reads and evaluates the top level forms of source one at a time, so that
+   memory does not grow with the size of the input, or with that of f,
+   read as needed, if given. A syntax error stops the load after the forms
+   before it have been evaluated. Copies of the forms are added to forms
+   if given, for the cache. */
+lval* lval_load_stream(lenv* e, const char* name, lsource& source, FILE* f,
+                       lval* forms) {
+  lreader r;
+  lreader_init(&r, name, source.data, source.size);
+  bool eof = f == NULL;
+  const char* released = source.data;
+  for (;;) {
+    const char* start = r.p;
+    long line = r.line;
+    int row = r.row;
+    lreader_skip(&r);
+    lval* y = r.p < r.end ? lreader_form(&r) : NULL;
+
+    /* What was read may go on in the part of f not read yet: keep the
+       input from the start of the form and read at least as much again */
+    if (r.p == r.end && !eof) {
+      if (y) { lval_del(y); }
+      if (r.err) { lval_del(r.err); r.err = NULL; }
+      size_t keep = start - r.data;
+      source.copy.erase(0, keep);
+      size_t want = std::max(source.copy.size(), (size_t)65536);
+      size_t have = source.copy.size();
+      source.copy.resize(have + want);
+      size_t n = fread(&source.copy[have], 1, want, f);
+      source.copy.resize(have + n);
+      if (n < want) {
+        if (ferror(f)) {
+          return lval_err("Could not load Library %s: cannot read file", name);
+        }
+        eof = true;
+      }
+      r.offset += keep;
+      r.data = r.p = source.copy.data();
+      r.end = r.data + source.copy.size();
+      r.line = line;
+      r.row = row;
+      continue;
+    }
+
+    if (!y) {
+      if (!r.err && r.p == r.end) { return lval_sexpr(); }
+      if (!r.err) { lreader_error(&r, "expression or end of input"); }
+      lval* err = lval_err("Could not load Library %s", r.err->err);
+      lval_del(r.err);
+      return err;
+    }
+    if (forms) { lval_add(forms, lval_copy(y)); }
+    lval_load_form(e, y);
+
+    /* Let go of the pages of a mapped file once read */
+    if (source.map && r.p - released > LSOURCE_RELEASE_BYTES) {
+      const char* upto = released +
+        (r.p - released) / LSOURCE_RELEASE_BYTES * LSOURCE_RELEASE_BYTES;
+      madvise((void*)released, upto - released, MADV_DONTNEED);
+      released = upto;
+    }
+  }
+}
+
+/* Evaluate the file called name, read from f if given */
+lval* lval_load(lenv* e, const char* name, FILE* f) {
+  lsource source;
+  if (f) {
+    source.data = source.copy.data();
+    return lval_load_stream(e, name, source, f, NULL);
+  }
+
+  /* Pipes and special files are streamed too */
+  struct stat st;
+  if (stat(name, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+    FILE* pipe = fopen(name, "rb");
+    if (!pipe) {
+      return lval_err("Could not load Library %s: cannot read file", name);
+    }
+    lval* x = lval_load(e, name, pipe);
+    fclose(pipe);
+    return x;
+  }
+
+  if (!lsource_open(source, name)) {
+    return lval_err("Could not load Library %s: cannot read file", name);
+  }
+  if (source.size > LCACHE_MAX_BYTES) {
+    return lval_load_stream(e, name, source, NULL, NULL);
+  }
+  unsigned long long hash = lhash(source.data, source.size);
+#ifdef ROOTURE_STDLIB_IMAGE
+  if (hash == lstdlib_image_hash) {
+    return lstdlib_image_install(e, lstdlib_image, sizeof(lstdlib_image));
+  }
+#endif
+
+  std::string cache = lcache_path(hash, source.size);
+  lval* forms = lcache_get(cache);
+  if (forms) {
+    for (int i = 0; i < forms->count; i++) {
+      lval_load_form(e, forms->cell[i]);
+    }
+    forms->count = 0;
+    lval_del(forms);
+    return lval_sexpr();
+  }
+
+  forms = lval_sexpr();
+  lval* x = lval_load_stream(e, name, source, NULL, forms);
+  if (x->type != LVAL_ERR) { lcache_put(cache, forms); }
+  lval_del(forms);
+  return x;
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+  lval* x = lval_load(e, a->cell[0]->str, NULL);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+
+  /* Print each argument followed by a space */
+  for (int i = 0; i < a->count; i++) {
+    lval_print(a->cell[i]); putchar(' ');
+  }
+
+  /* Print a newline and delete arguments */
+  putchar('\n');
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+  /* Construct Error from first argument */
+  lval* err = lval_err(a->cell[0]->str);
+
+  /* Delete arguments and return */
+  lval_del(a);
+  return err;
+}
+
+lval* builtin_exit(lenv* e, lval* a) {
+  LASSERT_NUM("exit", a, 1);
+  LASSERT_TYPE("exit", a, 0, LVAL_NUM);
+
+  exit(a->cell[0]->num);
+
+  /* Delete arguments and return */
+  lval_del(a);
+  return 0;
+}
+
+/* Recycling of frequently created objects. For the classes enabled with
+   'pool', objects released by the script are Reset() and kept on a free
+   list keyed by their constructor call, and the next 'new' with exactly
+   the same arguments gets one of them back instead of a fresh object. */
+#define LPOOL_MAX_FREE 64
+
+/* What Reset() does not undo: an object is only recycled if it still
+   looks like the one its constructor call made */
+struct lpool_shape {
+  std::string titles;      /* name, title and axis titles */
+  double axes[3][4];       /* bins, range and number of variable edges */
+  double attributes[8];    /* line, fill and marker */
+  bool labels;
+  bool sumw2;
+};
+
+void lpool_shape_of(TH1* h, lpool_shape* s) {
+  TAxis* axes[3] = { h->GetXaxis(), h->GetYaxis(), h->GetZaxis() };
+  s->titles = std::string(h->GetName()) + "\n" + h->GetTitle();
+  s->labels = false;
+  for (int i = 0; i < 3; i++) {
+    s->titles += std::string("\n") + axes[i]->GetTitle();
+    s->axes[i][0] = axes[i]->GetNbins();
+    s->axes[i][1] = axes[i]->GetXmin();
+    s->axes[i][2] = axes[i]->GetXmax();
+    s->axes[i][3] = axes[i]->GetXbins()->fN;
+    if (axes[i]->GetLabels()) { s->labels = true; }
+  }
+  double attributes[8] = {
+    (double)h->GetLineColor(), (double)h->GetLineStyle(), (double)h->GetLineWidth(),
+    (double)h->GetFillColor(), (double)h->GetFillStyle(),
+    (double)h->GetMarkerColor(), (double)h->GetMarkerStyle(), h->GetMarkerSize()
+  };
+  memcpy(s->attributes, attributes, sizeof(attributes));
+  s->sumw2 = h->GetSumw2N() != 0;
+}
+
+bool lpool_shape_same(const lpool_shape& x, const lpool_shape& y) {
+  return x.titles == y.titles && x.labels == y.labels && x.sumw2 == y.sumw2
+    && memcmp(x.axes, y.axes, sizeof(x.axes)) == 0
+    && memcmp(x.attributes, y.attributes, sizeof(x.attributes)) == 0;
+}
+
+struct lpool {
+  std::set<std::string> classes;
+  std::map<std::string, std::vector<TObject*> > free;
+  std::map<std::string, lpool_shape> shapes;   /* as constructed, per key */
+  long hits;
+  long misses;
+  long returned;
+};
+
+/* Counters start at zero as for any global */
+lpool lobj_pool;
+
+bool lpool_enabled(const char* className) {
+  std::lock_guard<std::mutex> lock(lglobal_mutex);
+  return lobj_pool.classes.count(className) != 0;
+}
+
+TObject* lpool_take(const std::string& key) {
+  std::lock_guard<std::mutex> lock(lglobal_mutex);
+  std::vector<TObject*>& list = lobj_pool.free[key];
+  if (list.empty()) { lobj_pool.misses++; return NULL; }
+  lobj_pool.hits++;
+  TObject* obj = list.back();
+  list.pop_back();
+  /* Register it again like a freshly constructed histogram would be */
+  if (TH1::AddDirectoryStatus()) { ((TH1*)obj)->SetDirectory(gDirectory); }
+  return obj;
+}
+
+/* Remember how the constructor call key sets up an object */
+void lpool_record(const std::string& key, TObject* obj) {
+  std::lock_guard<std::mutex> lock(lglobal_mutex);
+  if (lobj_pool.shapes.count(key)) { return; }
+  lpool_shape_of((TH1*)obj, &lobj_pool.shapes[key]);
+}
+
+/* Returns false if the object should be deleted instead: the pool is
+   full, or the script changed the object in a way Reset() keeps. Objects
+   still drawn in a pad never get here, see lobj_owned_by_root. */
+bool lpool_give(const char* key, TObject* obj) {
+  std::lock_guard<std::mutex> lock(lglobal_mutex);
+  std::vector<TObject*>& list = lobj_pool.free[key];
+  if (list.size() >= LPOOL_MAX_FREE) { return false; }
+  TH1* h = (TH1*)obj;
+  std::map<std::string, lpool_shape>::iterator made = lobj_pool.shapes.find(key);
+  lpool_shape shape;
+  lpool_shape_of(h, &shape);
+  if (made == lobj_pool.shapes.end() || !lpool_shape_same(made->second, shape)) { return false; }
+  h->Reset();
+  h->SetDirectory(NULL);
+  list.push_back(obj);
+  lobj_pool.returned++;
+  return true;
+}
+
+// Enables recycling for the given classes, e.g. (pool TH1F TH1D).
+lval* builtin_pool(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("pool", a, i, LVAL_STR);
+    TClass* cls = TClass::GetClass(a->cell[i]->str);
+    LASSERT(a, cls && cls->InheritsFrom(TH1::Class()),
+      "Function 'pool' can only recycle histograms, got %s.",
+      a->cell[i]->str);
+  }
+  for (int i = 0; i < a->count; i++) {
+    lobj_pool.classes.insert(a->cell[i]->str);
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// Returns {hits misses returned hit-rate} for the object pool.
+lval* builtin_pool_stats(lenv* e, lval* a) {
+  LASSERT_NUM("pool-stats", a, 0);
+  lval_del(a);
+  long requests = lobj_pool.hits + lobj_pool.misses;
+  lval* x = lval_qexpr();
+  lval_add(x, lval_num(lobj_pool.hits));
+  lval_add(x, lval_num(lobj_pool.misses));
+  lval_add(x, lval_num(lobj_pool.returned));
+  lval_add(x, lval_floating(requests ? (double)lobj_pool.hits / requests : 0.));
+  return x;
+}
+
+// Creates a new TObject
+lval *builtin_new(lenv *e, lval* a) {
+  LASSERT(a, a->count >= 1,
+    "Function 'new' needs at least 1 argument: <class name>.");
+  LASSERT_TYPE("new", a, 0, LVAL_STR);
+  // Create an object of the given class
+  const char *className = a->cell[0]->str;
+  std::string args = lval_to_cpp_arg(a, 1);
+
+  std::string ctorLine = std::string("new ") + className + "(" + args + ");";
+  lroot_init();
+  bool pooled = lpool_enabled(className);
+  TObject *obj = pooled ? lpool_take(ctorLine) : NULL;
+  if (!obj) {
+    obj = (TObject *)gInterpreter->Calc(ctorLine.c_str());
+    if (obj && pooled) { lpool_record(ctorLine, obj); }
+  }
+  if (!obj) {
+    lval* err = lval_err("Constructor not found for %s", className);
+    lval_del(a);
+    return err;
+  }
+
+  lval_del(a);
+  lval* v = lval_tobj_owned(obj);
+  if (pooled) { v->ref->pool_key = strdup(ctorLine.c_str()); }
+  return v;
+}
+
+// Invokes a method
+lval *builtin_invoke(lenv *e, lval *a) {
+  LASSERT_NUM("invoke", a, 2);
+  LASSERT_TYPE("invoke", a, 0, LVAL_TMETHOD);
+  LASSERT_TYPE("invoke", a, 1, LVAL_TOBJ);
+  LASSERT_ALIVE("invoke", a, 1);
+  TMethodCall *m = a->cell[0]->method;
+  const char *args = a->cell[0]->methodArgs;
+  lredraw_touch_value(a->cell[1]);
+  lroot_init();
+  m->Execute(a->cell[1]->obj, args);
+  lval_del(a);
+  return lval_qexpr();
+}
+
+/* Whether ROOT rather than ROOTure is responsible for deleting obj, which
+   is still alive: objects ROOT deleted were cleared by lobj_cleaner. */
+bool lobj_pad_contains(TVirtualPad* pad, TObject* obj) {
+  TIter next(pad->GetListOfPrimitives());
+  while (TObject* p = next()) {
+    if (p == obj) { return true; }
+    if (p->InheritsFrom(TVirtualPad::Class())
+        && lobj_pad_contains((TVirtualPad*)p, obj)) { return true; }
+  }
+  return false;
+}
+
+bool lobj_owned_by_root(TObject* obj) {
+  /* Canvases stay around until the user closes them */
+  if (obj->InheritsFrom(TVirtualPad::Class())) { return true; }
+
+  /* Histograms and trees attached to a file belong to it */
+  TDirectory* dir = NULL;
+  if (obj->InheritsFrom(TH1::Class())) { dir = ((TH1*)obj)->GetDirectory(); }
+  if (obj->InheritsFrom(TTree::Class())) { dir = ((TTree*)obj)->GetDirectory(); }
+  if (dir && dir != gROOT) { return true; }
+
+  /* Objects still drawn somewhere are handed over to the pad */
+  TIter next(gROOT->GetListOfCanvases());
+  while (TVirtualPad* canvas = (TVirtualPad*)next()) {
+    if (lobj_pad_contains(canvas, obj)) {
+      obj->SetBit(TObject::kCanDelete);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Owned objects dropped by tree-fold workers, which the main thread
+   releases once the workers are done, see lobj_release_deferred */
+std::vector<lobj*> lobj_deferred;
+
+/* Called when the last reference to an owned object goes away */
+void lobj_release(lobj* r) {
+  if (lworker) {
+    std::lock_guard<std::mutex> lock(lobj_mutex);
+    lobj_deferred.push_back(r);
+    return;
+  }
+  lobj_live--;
+  {
+    std::lock_guard<std::mutex> lock(lobj_mutex);
+    if (r->obj) { lobj_registry.erase(r->obj); }
+  }
+  if (r->obj && !lobj_owned_by_root(r->obj)) {
+    if (!r->pool_key || !lpool_give(r->pool_key, r->obj)) {
+      delete r->obj;
+    }
+  }
+  free(r->pool_key);
+  delete r;
+}
+
+void lobj_release_deferred() {
+  std::vector<lobj*> released;
+  {
+    std::lock_guard<std::mutex> lock(lobj_mutex);
+    released.swap(lobj_deferred);
+  }
+  for (size_t i = 0; i < released.size(); i++) { lobj_release(released[i]); }
+}
+
+// Returns the number of objects created by ROOTure which are still alive.
+lval* builtin_live_objects(lenv* e, lval* a) {
+  LASSERT_NUM("live-objects", a, 0);
+  lval_del(a);
+  return lval_num(lobj_live);
+}
+
+/* A data member resolved through TClass::GetRealData. The offset is
+   relative to the TObject* we are handed, so that reading it is just a
+   pointer add and a typed load. */
+enum { LFIELD_BASIC, LFIELD_OBJECT, LFIELD_OBJECT_PTR };
+
+struct lfield {
+  int kind;
+  long offset;
+  int type;       /* EDataType, for LFIELD_BASIC */
+  long base;      /* TObject offset inside the member, for objects */
+};
+
+/* Resolve (and cache) the field called name in the class of obj. Returns
+   NULL and fills err if the member cannot be accessed directly. */
+const lfield* lfield_find(TObject* obj, const char* name, lval** err) {
+  typedef std::pair<TClass*, std::string> lfield_key;
+  static std::map<lfield_key, lfield> cache;
+
+  TClass* cls = obj->IsA();
+  lfield_key key(cls, name);
+  std::lock_guard<std::mutex> lock(lglobal_mutex);
+  std::map<lfield_key, lfield>::iterator it = cache.find(key);
+  if (it != cache.end()) { return &it->second; }
+
+  TRealData* rd = cls->GetRealData(name);
+  TDataMember* dm = rd ? rd->GetDataMember() : NULL;
+  if (!dm) {
+    *err = lval_err("Class %s has no data member %s.", cls->GetName(), name);
+    return NULL;
+  }
+  if (dm->GetArrayDim() > 0) {
+    *err = lval_err("Data member %s::%s is an array.", cls->GetName(), name);
+    return NULL;
+  }
+
+  /* TObject is not necessarily the first base, so account for where it
+     lives inside the full object. */
+  lfield f;
+  f.offset = rd->GetThisOffset() - cls->GetBaseClassOffset(TObject::Class());
+  f.type = kNoType_t;
+  f.base = 0;
+
+  TClass* mcls = dm->IsBasic() ? NULL : TClass::GetClass(dm->GetTypeName());
+  if (dm->IsBasic() && !dm->IsaPointer() && dm->GetDataType()) {
+    f.kind = LFIELD_BASIC;
+    f.type = dm->GetDataType()->GetType();
+  } else if (mcls && mcls->InheritsFrom(TObject::Class())) {
+    f.kind = dm->IsaPointer() ? LFIELD_OBJECT_PTR : LFIELD_OBJECT;
+    /* Point at the TObject part of the member */
+    f.base = mcls->GetBaseClassOffset(TObject::Class());
+  } else {
+    *err = lval_err("Data member %s::%s has unsupported type %s.",
+      cls->GetName(), name, dm->GetFullTypeName());
+    return NULL;
+  }
+  return &(cache[key] = f);
+}
+
+lval* lfield_load(const lfield* f, char* addr, lobj* owner) {
+  switch (f->kind) {
+    case LFIELD_OBJECT:
+      return lval_tobj_shared((TObject*)(addr + f->base), owner);
+    case LFIELD_OBJECT_PTR:
+      addr = *(char**)addr;
+      return lval_tobj_shared(addr ? (TObject*)(addr + f->base) : NULL, owner);
+  }
+  switch (f->type) {
+    case kBool_t:     return lval_num(*(Bool_t*)addr);
+    case kChar_t:     return lval_num(*(Char_t*)addr);
+    case kUChar_t:    return lval_num(*(UChar_t*)addr);
+    case kShort_t:    return lval_num(*(Short_t*)addr);
+    case kUShort_t:   return lval_num(*(UShort_t*)addr);
+    case kInt_t:      return lval_num(*(Int_t*)addr);
+    case kUInt_t:     return lval_num(*(UInt_t*)addr);
+    case kLong_t:     return lval_num(*(Long_t*)addr);
+    case kULong_t:    return lval_num(*(ULong_t*)addr);
+    case kLong64_t:   return lval_num(*(Long64_t*)addr);
+    case kULong64_t:  return lval_num(*(ULong64_t*)addr);
+    case kFloat_t:
+    case kFloat16_t:  return lval_floating(*(Float_t*)addr);
+    case kDouble_t:
+    case kDouble32_t: return lval_floating(*(Double_t*)addr);
+    default: return lval_err("Cannot read data member of type %i.", f->type);
+  }
+}
+
+lval* lfield_store(const lfield* f, char* addr, lval* v) {
+  if (f->kind != LFIELD_BASIC) {
+    return lval_err("Cannot assign to an object data member.");
+  }
+  if (v->type != LVAL_NUM && v->type != LVAL_FLOAT) {
+    return lval_err("Cannot assign %s to a numeric data member.",
+      ltype_name(v->type));
+  }
+  switch (f->type) {
+    case kBool_t:     *(Bool_t*)addr = lval_to_long(v) != 0; break;
+    case kChar_t:     *(Char_t*)addr = lval_to_long(v); break;
+    case kUChar_t:    *(UChar_t*)addr = lval_to_long(v); break;
+    case kShort_t:    *(Short_t*)addr = lval_to_long(v); break;
+    case kUShort_t:   *(UShort_t*)addr = lval_to_long(v); break;
+    case kInt_t:      *(Int_t*)addr = lval_to_long(v); break;
+    case kUInt_t:     *(UInt_t*)addr = lval_to_long(v); break;
+    case kLong_t:     *(Long_t*)addr = lval_to_long(v); break;
+    case kULong_t:    *(ULong_t*)addr = lval_to_long(v); break;
+    case kLong64_t:   *(Long64_t*)addr = lval_to_long(v); break;
+    case kULong64_t:  *(ULong64_t*)addr = lval_to_long(v); break;
+    case kFloat_t:
+    case kFloat16_t:  *(Float_t*)addr = lval_to_double(v); break;
+    case kDouble_t:
+    case kDouble32_t: *(Double_t*)addr = lval_to_double(v); break;
+    default: return lval_err("Cannot write data member of type %i.", f->type);
+  }
+  return lfield_load(f, addr, NULL);
+}
+
+// Reads or writes a data member of an object directly in memory.
+// - (field fEntries h1) returns the value of h1->fEntries.
+// - (field fEntries h1 10) sets it and returns the new value.
+lval* builtin_field(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'field' needs 2 or 3 arguments: <member> <object> [value].");
+  LASSERT_TYPE("field", a, 0, LVAL_STR);
+  LASSERT_TYPE("field", a, 1, LVAL_TOBJ);
+  LASSERT_ALIVE("field", a, 1);
+  LASSERT(a, a->cell[1]->obj, "Function 'field' passed a null object.");
+
+  TObject* obj = a->cell[1]->obj;
+  lval* err = NULL;
+  const lfield* f = lfield_find(obj, a->cell[0]->str, &err);
+  if (!f) { lval_del(a); return err; }
+
+  char* addr = (char*)obj + f->offset;
+  if (a->count == 3) { lredraw_touch_value(a->cell[1]); }
+  lval* x = a->count == 3 ? lfield_store(f, addr, a->cell[2])
+                          : lfield_load(f, addr, a->cell[1]->ref);
+  lval_del(a);
+  return x;
+}
+
+/* Numeric arrays. Operations are written once as templates over the
+   element type and dispatched on atype, so that loops run on the typed
+   memory directly, whether it belongs to ROOTure or to a ROOT object. */
+#define LARRAY_SWITCH(atype, CASE)              \
+  switch (atype) {                              \
+    case kDouble_t:  CASE(Double_t);  break;    \
+    case kFloat_t:   CASE(Float_t);   break;    \
+    case kLong64_t:  CASE(Long64_t);  break;    \
+    case kULong64_t: CASE(ULong64_t); break;    \
+    case kInt_t:     CASE(Int_t);     break;    \
+    case kUInt_t:    CASE(UInt_t);    break;    \
+    case kShort_t:   CASE(Short_t);   break;    \
+    case kUShort_t:  CASE(UShort_t);  break;    \
+    case kChar_t:    CASE(Char_t);    break;    \
+    case kUChar_t:                              \
+    case kBool_t:    CASE(UChar_t);   break;    \
+  }
+
+#define LASSERT_WRITABLE(what, a, n)                                \
+    LASSERT(a, !a->cell[n]->readonly,                               \
+            "Function '%s' cannot modify a read-only array.", what);
+
+/* Writes through a view change the object it belongs to */
+void larray_touch(lval* x) {
+  if (x->ref) { lredraw_touch(x->ref->obj); }
+}
+
+bool larray_is_integer(int atype) {
+  return atype != kDouble_t && atype != kFloat_t;
+}
+
+double larray_get(lval* a, long i) {
+  double x = 0;
+#define GET(T) x = ((T*)a->data)[i]
+  LARRAY_SWITCH(a->atype, GET)
+#undef GET
+  return x;
+}
+
+void larray_set(lval* a, long i, double x) {
+#define SET(T) ((T*)a->data)[i] = (T)x
+  LARRAY_SWITCH(a->atype, SET)
+#undef SET
+}
+
+/* Reductions keep four independent accumulators so the loop is not
+   serialised on a single floating point dependency. */
+template <typename T>
+double larray_sum(const T* p, long n) {
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += p[i]; s1 += p[i+1]; s2 += p[i+2]; s3 += p[i+3];
+  }
+  for (; i < n; i++) { s0 += p[i]; }
+  return (s0 + s1) + (s2 + s3);
+}
+
+template <typename T>
+double larray_min(const T* p, long n) {
+  T m = p[0];
+  for (long i = 1; i < n; i++) { m = p[i] < m ? p[i] : m; }
+  return m;
+}
+
+template <typename T>
+double larray_max(const T* p, long n) {
+  T m = p[0];
+  for (long i = 1; i < n; i++) { m = p[i] > m ? p[i] : m; }
+  return m;
+}
+
+template <typename T>
+void larray_scale(T* p, long n, double k) {
+  for (long i = 0; i < n; i++) { p[i] = (T)(p[i] * k); }
+}
+
+template <typename T>
+void larray_fill(T* p, long n, double x) {
+  for (long i = 0; i < n; i++) { p[i] = (T)x; }
+}
+
+/* y += k * x */
+template <typename T, typename U>
+void larray_axpy(T* y, const U* x, long n, double k) {
+  for (long i = 0; i < n; i++) { y[i] = (T)(y[i] + k * x[i]); }
+}
+
+/* y += k * x, for any element type of x. The preprocessor does not expand
+   LARRAY_SWITCH inside its own expansion, so the second dispatch happens
+   here rather than in a nested macro. */
+template <typename T>
+void larray_axpy(T* y, lval* x, double k) {
+#define AXPY(U) larray_axpy(y, (U*)x->data, x->length, k)
+  LARRAY_SWITCH(x->atype, AXPY)
+#undef AXPY
+}
+
+/* Number lval of the right kind for an array element */
+lval* larray_item(lval* a, long i) {
+  double x = larray_get(a, i);
+  return larray_is_integer(a->atype) ? lval_num((long)x) : lval_floating(x);
+}
+
+// Creates a new array of doubles, either n zeros or the given numbers:
+// (array 1000) or (array {1 2 3}).
+lval* builtin_array(lenv* e, lval* a) {
+  LASSERT_NUM("array", a, 1);
+  lval* x;
+  if (a->cell[0]->type == LVAL_NUM) {
+    LASSERT(a, a->cell[0]->num >= 0, "Function 'array' passed a negative size.");
+    x = lval_array(a->cell[0]->num, kDouble_t);
+  } else {
+    LASSERT_TYPE("array", a, 0, LVAL_QEXPR);
+    lval* l = a->cell[0];
+    for (int i = 0; i < l->count; i++) {
+      LASSERT(a, l->cell[i]->type == LVAL_NUM || l->cell[i]->type == LVAL_FLOAT,
+              "Function 'array' passed incorrect type for element %i. "
+              "Got %s, expected %s.", i,
+              ltype_name(l->cell[i]->type), ltype_name(LVAL_FLOAT));
+    }
+    x = lval_array(l->count, kDouble_t);
+    for (int i = 0; i < l->count && x->type == LVAL_ARRAY; i++) {
+      ((Double_t*)x->data)[i] = lval_to_double(l->cell[i]);
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Views onto the storage of ROOT objects */
+lval* larray_view_of(lval* o, const char* what, int readonly) {
+  TObject* obj = o->obj;
+  if (obj && obj->InheritsFrom(TH1::Class())) {
+    TH1* h = (TH1*)obj;
+    if (strcmp(what, "sumw2") == 0) {
+      if (!h->GetSumw2N()) { return lval_err("Histogram has no sum of weights."); }
+      return lval_array_view(h->GetSumw2()->GetArray(), h->GetSumw2N(),
+        kDouble_t, readonly, o->ref);
+    }
+    if (strcmp(what, "contents") != 0) {
+      return lval_err("Histograms have 'contents' and 'sumw2', not '%s'.", what);
+    }
+    /* Contents, including under and overflow bins, are stored in the
+       TArray the concrete histogram class derives from. */
+    if (TArrayD* d = dynamic_cast<TArrayD*>(obj)) {
+      return lval_array_view(d->GetArray(), d->fN, kDouble_t, readonly, o->ref);
+    }
+    if (TArrayF* f = dynamic_cast<TArrayF*>(obj)) {
+      return lval_array_view(f->GetArray(), f->fN, kFloat_t, readonly, o->ref);
+    }
+    if (TArrayI* i = dynamic_cast<TArrayI*>(obj)) {
+      return lval_array_view(i->GetArray(), i->fN, kInt_t, readonly, o->ref);
+    }
+    if (TArrayS* s = dynamic_cast<TArrayS*>(obj)) {
+      return lval_array_view(s->GetArray(), s->fN, kShort_t, readonly, o->ref);
+    }
+    if (TArrayC* c = dynamic_cast<TArrayC*>(obj)) {
+      return lval_array_view(c->GetArray(), c->fN, kChar_t, readonly, o->ref);
+    }
+    return lval_err("Unsupported histogram storage for %s.", obj->ClassName());
+  }
+  if (obj && obj->InheritsFrom(TGraph::Class())) {
+    TGraph* g = (TGraph*)obj;
+    if (strcmp(what, "x") == 0) {
+      return lval_array_view(g->GetX(), g->GetN(), kDouble_t, readonly, o->ref);
+    }
+    if (strcmp(what, "y") == 0) {
+      return lval_array_view(g->GetY(), g->GetN(), kDouble_t, readonly, o->ref);
+    }
+    return lval_err("Graphs have 'x' and 'y', not '%s'.", what);
+  }
+  if (obj && obj->InheritsFrom(TVectorD::Class())) {
+    TVectorD* v = (TVectorD*)obj;
+    return lval_array_view(v->GetMatrixArray(), v->GetNoElements(),
+      kDouble_t, readonly, o->ref);
+  }
+  if (obj && obj->InheritsFrom(TVectorF::Class())) {
+    TVectorF* v = (TVectorF*)obj;
+    return lval_array_view(v->GetMatrixArray(), v->GetNoElements(),
+      kFloat_t, readonly, o->ref);
+  }
+  return lval_err("Cannot view the storage of %s.",
+    obj ? obj->ClassName() : "a null object");
+}
+
+lval* builtin_view_any(lenv* e, lval* a, const char* func, int readonly) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function '%s' needs 1 or 2 arguments: <object> [what].", func);
+  LASSERT_TYPE(func, a, 0, LVAL_TOBJ);
+  LASSERT_ALIVE(func, a, 0);
+  if (a->count == 2) { LASSERT_TYPE(func, a, 1, LVAL_STR); }
+  const char* what = a->count == 2 ? a->cell[1]->str : "contents";
+  TObject* obj = a->cell[0]->obj;
+  if (obj && obj->InheritsFrom(TGraph::Class()) && a->count == 1) { what = "y"; }
+  lval* x = larray_view_of(a->cell[0], what, readonly);
+  lval_del(a);
+  return x;
+}
+
+// Aliases the storage of a histogram (contents or sumw2), a graph (x or y)
+// or a vector as an array, without copying. The view keeps the object
+// alive, but becomes invalid if the object reallocates its storage.
+lval* builtin_view(lenv* e, lval* a) {
+  return builtin_view_any(e, a, "view", 0);
+}
+
+lval* builtin_view_const(lenv* e, lval* a) {
+  return builtin_view_any(e, a, "view-const", 1);
+}
+
+lval* builtin_aget(lenv* e, lval* a) {
+  LASSERT_NUM("aget", a, 2);
+  LASSERT_TYPE("aget", a, 0, LVAL_ARRAY);
+  LASSERT_ALIVE("aget", a, 0);
+  LASSERT_TYPE("aget", a, 1, LVAL_NUM);
+  long i = a->cell[1]->num;
+  LASSERT(a, i >= 0 && i < a->cell[0]->length,
+    "Function 'aget' index %li out of range.", i);
+  lval* x = larray_item(a->cell[0], i);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_aset(lenv* e, lval* a) {
+  LASSERT_NUM("aset", a, 3);
+  LASSERT_TYPE("aset", a, 0, LVAL_ARRAY);
+  LASSERT_ALIVE("aset", a, 0);
+  LASSERT_TYPE("aset", a, 1, LVAL_NUM);
+  LASSERT_NUMERIC("aset", a, 2);
+  LASSERT_WRITABLE("aset", a, 0);
+  larray_touch(a->cell[0]);
+  long i = a->cell[1]->num;
+  LASSERT(a, i >= 0 && i < a->cell[0]->length,
+    "Function 'aset' index %li out of range.", i);
+  larray_set(a->cell[0], i, lval_to_double(a->cell[2]));
+  return lval_take(a, 0);
+}
+
+lval* builtin_areduce(lenv* e, lval* a, const char* op) {
+  LASSERT_NUM(op, a, 1);
+  LASSERT_TYPE(op, a, 0, LVAL_ARRAY);
+  LASSERT_ALIVE(op, a, 0);
+  lval* x = a->cell[0];
+  double r = 0;
+  if (strcmp(op, "asum") == 0) {
+#define SUM(T) r = larray_sum((T*)x->data, x->length)
+    LARRAY_SWITCH(x->atype, SUM)
+#undef SUM
+  } else {
+    LASSERT(a, x->length > 0, "Function '%s' passed an empty array.", op);
+    if (strcmp(op, "amin") == 0) {
+#define MIN(T) r = larray_min((T*)x->data, x->length)
+      LARRAY_SWITCH(x->atype, MIN)
+#undef MIN
+    } else {
+#define MAX(T) r = larray_max((T*)x->data, x->length)
+      LARRAY_SWITCH(x->atype, MAX)
+#undef MAX
+    }
+  }
+  int integer = larray_is_integer(x->atype);
+  lval_del(a);
+  return integer ? lval_num((long)r) : lval_floating(r);
+}
+
+lval* builtin_asum(lenv* e, lval* a) { return builtin_areduce(e, a, "asum"); }
+lval* builtin_amin(lenv* e, lval* a) { return builtin_areduce(e, a, "amin"); }
+lval* builtin_amax(lenv* e, lval* a) { return builtin_areduce(e, a, "amax"); }
+
+// Multiplies every element by k in place: (ascale a k).
+lval* builtin_ascale(lenv* e, lval* a) {
+  LASSERT_NUM("ascale", a, 2);
+  LASSERT_TYPE("ascale", a, 0, LVAL_ARRAY);
+  LASSERT_ALIVE("ascale", a, 0);
+  LASSERT_NUMERIC("ascale", a, 1);
+  LASSERT_WRITABLE("ascale", a, 0);
+  larray_touch(a->cell[0]);
+  lval* x = a->cell[0];
+  double k = lval_to_double(a->cell[1]);
+#define SCALE(T) larray_scale((T*)x->data, x->length, k)
+  LARRAY_SWITCH(x->atype, SCALE)
+#undef SCALE
+  return lval_take(a, 0);
+}
+
+// Sets every element to v in place: (afill a v).
+lval* builtin_afill(lenv* e, lval* a) {
+  LASSERT_NUM("afill", a, 2);
+  LASSERT_TYPE("afill", a, 0, LVAL_ARRAY);
+  LASSERT_ALIVE("afill", a, 0);
+  LASSERT_NUMERIC("afill", a, 1);
+  LASSERT_WRITABLE("afill", a, 0);
+  larray_touch(a->cell[0]);
+  lval* x = a->cell[0];
+  double v = lval_to_double(a->cell[1]);
+#define FILL(T) larray_fill((T*)x->data, x->length, v)
+  LARRAY_SWITCH(x->atype, FILL)
+#undef FILL
+  return lval_take(a, 0);
+}
+
+// Adds k times x to y in place: (aadd y x [k]).
+lval* builtin_aadd(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'aadd' needs 2 or 3 arguments: <y> <x> [k].");
+  LASSERT_TYPE("aadd", a, 0, LVAL_ARRAY);
+  LASSERT_ALIVE("aadd", a, 0);
+  LASSERT_TYPE("aadd", a, 1, LVAL_ARRAY);
+  LASSERT_ALIVE("aadd", a, 1);
+  if (a->count == 3) { LASSERT_NUMERIC("aadd", a, 2); }
+  LASSERT_WRITABLE("aadd", a, 0);
+  larray_touch(a->cell[0]);
+  lval* y = a->cell[0];
+  lval* x = a->cell[1];
+  LASSERT(a, x->length == y->length,
+    "Function 'aadd' passed arrays of different lengths, %li and %li.",
+    y->length, x->length);
+  double k = a->count == 3 ? lval_to_double(a->cell[2]) : 1.;
+#define AXPY(T) larray_axpy((T*)y->data, x, k)
+  LARRAY_SWITCH(y->atype, AXPY)
+#undef AXPY
+  return lval_take(a, 0);
+}
+
+// Copies an array into a list of numbers.
+lval* builtin_alist(lenv* e, lval* a) {
+  LASSERT_NUM("alist", a, 1);
+  LASSERT_TYPE("alist", a, 0, LVAL_ARRAY);
+  LASSERT_ALIVE("alist", a, 0);
+  lval* x = lval_qexpr();
+  for (long i = 0; i < a->cell[0]->length; i++) {
+    lval_add(x, larray_item(a->cell[0], i));
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Checks that argument n is a handle of the given class and binds it */
+#define LASSERT_HANDLE(what, a, n, klass, var)                      \
+    LASSERT_TYPE(what, a, n, LVAL_HANDLE);                          \
+    klass* var = dynamic_cast<klass*>(a->cell[n]->handle);          \
+    LASSERT(a, var, "Function '%s' passed a %s, expected a %s.",    \
+            what, a->cell[n]->handle->Kind(), #klass);
+
+/* Array element type for the type name of a scalar leaf */
+int larray_type_of(const char* typeName) {
+  static const struct { const char* name; int atype; } types[] = {
+    { "Double_t", kDouble_t }, { "Float_t", kFloat_t },
+    { "Long64_t", kLong64_t }, { "ULong64_t", kULong64_t },
+    { "Int_t", kInt_t }, { "UInt_t", kUInt_t },
+    { "Short_t", kShort_t }, { "UShort_t", kUShort_t },
+    { "Char_t", kChar_t }, { "UChar_t", kUChar_t }, { "Bool_t", kBool_t },
+  };
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    if (strcmp(types[i].name, typeName) == 0) { return types[i].atype; }
+  }
+  return kNoType_t;
+}
+
+/* TFile::Open makes the file it opens the current directory, to which
+   the script's next histograms would then belong and with which ROOT
+   would delete them. Files are opened without changing gDirectory. */
+TFile* lfile_open_quiet(const char* name, const char* option = "") {
+  TDirectory::TContext ctx(gDirectory);
+  return TFile::Open(name, option);
+}
+
+/* Columnar reader for scalar branches of a tree. Only the selected
+   branches are enabled and each is bound to a scalar slot, from which
+   entries are copied into typed arrays one chunk at a time. The arrays
+   of the previous chunk are reused when the script no longer holds
+   them, so a scan allocates only once. With prefetching enabled, a
+   background thread reads ahead up to depth chunks while the script works
+   on the current one. */
+struct ltree_column {
+  std::string name;
+  int atype;
+  Long64_t slot;   /* large enough for any scalar leaf, which ROOT reads
+                      and writes at its start */
+  lval* values;
+};
+
+struct ltree_reader : lhandle {
+  TFile* file;     /* only set if we opened it */
+  TChain* chain;   /* set when reading a list of files */
+  lobj* owner;     /* keeps a file passed by the script alive */
+  TTree* tree;
+  std::vector<ltree_column> columns;
+  Long64_t next;
+  Long64_t last;   /* one past the last entry to read */
+  long chunk;
+
+  /* What reading changed on a tree the script passed in, put back when the
+     reader goes: branches that were switched off and the cache size */
+  std::vector<std::pair<TBranch*, bool> > statuses;
+  Long64_t cacheSize;
+
+  /* Prefetching. Once the thread runs, only it touches the tree, and the
+     chunks it has read wait in ready, guarded by lock. */
+  std::thread prefetcher;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<lval*> ready;
+  int depth;
+  bool stop;
+  bool done;
+
+  /* Statistics: chunks read, time spent reading them and time the script
+     spent waiting for them */
+  long chunks;
+  double readTime;
+  double waitTime;
+
+  ltree_reader() : file(NULL), chain(NULL), owner(NULL), tree(NULL), next(0), last(0), chunk(0),
+                   cacheSize(0), depth(0), stop(false), done(false), chunks(0), readTime(0), waitTime(0) {}
+  ~ltree_reader() {
+    StopPrefetch();
+    for (size_t i = 0; i < columns.size(); i++) {
+      if (columns[i].values) { lval_del(columns[i].values); }
+    }
+    if (file) {
+      delete file;
+    } else if (chain) {
+      delete chain;
+    } else if (tree) {
+      tree->ResetBranchAddresses();
+      for (size_t i = 0; i < statuses.size(); i++) {
+        statuses[i].first->SetBit(kDoNotProcess, statuses[i].second);
+      }
+      /* Dropping the cache also drops the branches and range primed in it */
+      tree->SetCacheSize(0);
+      if (cacheSize > 0) { tree->SetCacheSize(cacheSize); }
+    }
+    if (owner && --owner->refs == 0) { lobj_release(owner); }
+  }
+  const char* Kind() const { return "tree-reader"; }
+
+  /* Stop the thread and drop the chunks it read ahead, rewinding to the
+     first of them so that they are read again */
+  void StopPrefetch() {
+    if (!prefetcher.joinable()) { return; }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+    changed.notify_all();
+    prefetcher.join();
+    for (size_t i = 0; i < ready.size(); i++) {
+      lval* t = ready[i];
+      if (t->type != LVAL_ERR && t->count > 0) { next -= t->cell[0]->cell[1]->length; }
+      lval_del(t);
+    }
+    ready.clear();
+  }
+};
+
+/* Default number of entries per chunk */
+#define LTREE_CHUNK 100000
+
+/* Record whether each branch under branches, at any depth, is switched off */
+void lbranch_statuses(TObjArray* branches, std::vector<std::pair<TBranch*, bool> >& out) {
+  for (int i = 0; i < branches->GetEntriesFast(); i++) {
+    TBranch* b = (TBranch*)branches->At(i);
+    out.push_back(std::make_pair(b, b->TestBit(kDoNotProcess)));
+    lbranch_statuses(b->GetListOfBranches(), out);
+  }
+}
+
+/* Open tree name in source (a file name, a list of file names to chain or
+   a directory object) and set up a reader for the given branches over
+   entries [first, last). */
+lval* ltree_reader_new(lval* source, const char* name, lval* branches,
+                       Long64_t first, Long64_t last, long chunk) {
+  /* Opening files goes through gDirectory, a single global on ROOT 5, so
+     tree-fold workers set up their readers one at a time */
+  std::unique_lock<std::mutex> guard(lglobal_mutex, std::defer_lock);
+  if (lworker) { guard.lock(); }
+  TDirectory::TContext ctx(gDirectory);
+  ltree_reader* r = new ltree_reader();
+  lval* x = lval_handle(r);
+  TDirectory* dir = NULL;
+  if (source->type == LVAL_QEXPR) {
+    r->chain = new TChain(name);
+    for (int i = 0; i < source->count; i++) {
+      if (source->cell[i]->type != LVAL_STR) {
+        lval_del(x);
+        return lval_err("File names must be strings.");
+      }
+      r->chain->Add(source->cell[i]->str);
+    }
+    r->tree = r->chain;
+  } else if (source->type == LVAL_STR) {
+    r->file = lfile_open_quiet(source->str);
+    if (!r->file || r->file->IsZombie()) {
+      lval_del(x);
+      return lval_err("Could not open file %s.", source->str);
+    }
+    dir = r->file;
+  } else if (source->obj && source->obj->InheritsFrom(TDirectory::Class())) {
+    dir = (TDirectory*)source->obj;
+    r->owner = source->ref;
+    if (r->owner) { r->owner->refs++; }
+  } else {
+    lval_del(x);
+    return lval_err("Trees can only be read from a file name or a directory.");
+  }
+
+  if (dir) {
+    TObject* obj = dir->Get(name);
+    r->tree = obj && obj->InheritsFrom(TTree::Class()) ? (TTree*)obj : NULL;
+  }
+  if (!r->tree) {
+    lval_del(x);
+    return lval_err("No tree called %s.", name);
+  }
+
+  /* Work out the columns before touching the tree */
+  for (int i = 0; i < branches->count; i++) {
+    if (branches->cell[i]->type != LVAL_STR && branches->cell[i]->type != LVAL_SYM) {
+      lval_del(x);
+      return lval_err("Branch names must be strings.");
+    }
+    const char* bname = branches->cell[i]->type == LVAL_STR
+      ? branches->cell[i]->str : branches->cell[i]->sym;
+    TBranch* b = r->tree->GetBranch(bname);
+    TLeaf* leaf = b ? (TLeaf*)b->GetListOfLeaves()->At(0) : NULL;
+    if (!leaf || b->GetListOfLeaves()->GetEntries() != 1) {
+      lval_del(x);
+      return lval_err("Branch %s is not a scalar branch.", bname);
+    }
+    int atype = larray_type_of(leaf->GetTypeName());
+    if (atype == kNoType_t || leaf->GetLen() != 1 || leaf->GetLeafCount()) {
+      lval_del(x);
+      return lval_err("Branch %s has unsupported type %s.", bname, leaf->GetTypeName());
+    }
+    ltree_column c;
+    c.name = bname;
+    c.atype = atype;
+    c.slot = 0;
+    c.values = NULL;
+    r->columns.push_back(c);
+  }
+
+  Long64_t entries = r->tree->GetEntries();
+  r->next = first < 0 ? 0 : first;
+  r->last = last < 0 || last > entries ? entries : last;
+  r->chunk = chunk > 0 ? chunk : LTREE_CHUNK;
+
+  /* Read only what we need, through a cache sized from the tree's own
+     clustering and primed for exactly these branches and entries. */
+  if (!r->file && !r->chain) {
+    lbranch_statuses(r->tree->GetListOfBranches(), r->statuses);
+    r->cacheSize = r->tree->GetCacheSize();
+  }
+  r->tree->SetBranchStatus("*", kFALSE);
+  r->tree->SetCacheSize(-1);
+  for (size_t i = 0; i < r->columns.size(); i++) {
+    ltree_column& c = r->columns[i];
+    r->tree->SetBranchStatus(c.name.c_str(), kTRUE);
+    /* Untyped, so that ROOT writes a leaf of any type at the slot rather
+       than refusing it for not being a Long64_t */
+    r->tree->SetBranchAddress(c.name.c_str(), (void*)&c.slot);
+    r->tree->AddBranchToCache(c.name.c_str(), kTRUE);
+  }
+  r->tree->SetCacheEntryRange(r->next, r->last);
+  r->tree->StopCacheLearningPhase();
+  return x;
+}
+
+/* Read the next chunk from the tree as a table, {} once the range is
+   exhausted. Arrays are only reused if reuse is set. */
+lval* ltree_reader_chunk(ltree_reader* r, bool reuse) {
+  lval* table = lval_qexpr();
+  if (r->next >= r->last) { return table; }
+  Long64_t n = r->last - r->next < r->chunk ? r->last - r->next : r->chunk;
+
+  for (size_t i = 0; i < r->columns.size(); i++) {
+    ltree_column& c = r->columns[i];
+    if (c.values && (!reuse || c.values->buf->refs > 1)) {
+      lval_del(c.values);
+      c.values = NULL;
+    }
+    if (!c.values) {
+      lval* x = lval_array(r->chunk, c.atype);
+      if (x->type == LVAL_ERR) { lval_del(table); return x; }
+      c.values = x;
+    }
+    c.values->length = n;
+  }
+
+  for (Long64_t k = 0; k < n; k++) {
+    /* A chain opens its next file when it reaches it, see ltree_reader_new */
+    if (r->chain && lworker && (r->chain->GetTreeNumber() < 0
+        || r->next + k >= r->chain->GetTreeOffset()[r->chain->GetTreeNumber() + 1])) {
+      std::lock_guard<std::mutex> guard(lglobal_mutex);
+      TDirectory::TContext ctx(gDirectory);
+      r->chain->LoadTree(r->next + k);
+    }
+    if (r->tree->GetEntry(r->next + k) < 0) {
+      lval_del(table);
+      return lval_err("I/O error reading entry %lli.", r->next + k);
+    }
+    for (size_t i = 0; i < r->columns.size(); i++) {
+      ltree_column& c = r->columns[i];
+      size_t size = larray_size(c.atype);
+      memcpy((char*)c.values->data + k * size, &c.slot, size);
+    }
+  }
+  r->next += n;
+
+  for (size_t i = 0; i < r->columns.size(); i++) {
+    lval* row = lval_qexpr();
+    lval_add(row, lval_str(r->columns[i].name.c_str()));
+    lval_add(row, lval_copy(r->columns[i].values));
+    lval_add(table, row);
+  }
+  return table;
+}
+
+/* Body of the prefetching thread */
+void ltree_reader_prefetch(ltree_reader* r) {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(r->lock);
+      while (!r->stop && (int)r->ready.size() >= r->depth) { r->changed.wait(guard); }
+      if (r->stop) { return; }
+    }
+    double start = lclock();
+    lval* table = ltree_reader_chunk(r, false);
+    bool last = table->type == LVAL_ERR || table->count == 0;
+    {
+      std::lock_guard<std::mutex> guard(r->lock);
+      if (!last) { r->chunks++; }
+      r->readTime += lclock() - start;
+      r->ready.push_back(table);
+      r->done = last;
+    }
+    r->changed.notify_all();
+    if (last) { return; }
+  }
+}
+
+/* Read the next chunk as a table, {} once the range is exhausted */
+lval* ltree_reader_read(ltree_reader* r) {
+  if (!r->prefetcher.joinable()) {
+    double start = lclock();
+    lval* table = ltree_reader_chunk(r, true);
+    if (table->type != LVAL_ERR && table->count > 0) { r->chunks++; }
+    r->readTime += lclock() - start;
+    r->waitTime += lclock() - start;
+    return table;
+  }
+  double start = lclock();
+  std::unique_lock<std::mutex> guard(r->lock);
+  while (r->ready.empty()) { r->changed.wait(guard); }
+  r->waitTime += lclock() - start;
+  lval* table = r->ready.front();
+  /* Keep the end of the range (or the error) for any later read */
+  if (r->done && r->ready.size() == 1) { return lval_copy(table); }
+  r->ready.pop_front();
+  guard.unlock();
+  r->changed.notify_all();
+  return table;
+}
+
+/* Shared argument handling of tree-reader and read-tree */
+lval* builtin_tree_reader_any(lenv* e, lval* a, const char* func, int ranged) {
+  int min = 3, max = ranged ? 6 : 5;
+  LASSERT(a, a->count >= min && a->count <= max,
+    "Function '%s' passed %i arguments, expected %i to %i.",
+    func, a->count, min, max);
+  LASSERT(a, a->cell[0]->type == LVAL_STR || a->cell[0]->type == LVAL_QEXPR
+             || a->cell[0]->type == LVAL_TOBJ,
+    "Function '%s' needs a file name, a list of them or a directory.", func);
+  LASSERT_ALIVE(func, a, 0);
+  LASSERT_TYPE(func, a, 1, LVAL_STR);
+  LASSERT_TYPE(func, a, 2, LVAL_QEXPR);
+  for (int i = 3; i < a->count; i++) { LASSERT_TYPE(func, a, i, LVAL_NUM); }
+
+  /* tree-reader takes a chunk size before the range */
+  int range = ranged ? 4 : 3;
+  long chunk = ranged && a->count > 3 ? a->cell[3]->num : 0;
+  Long64_t first = a->count > range ? a->cell[range]->num : 0;
+  Long64_t last = a->count > range + 1 ? a->cell[range + 1]->num : -1;
+
+  lval* x = ltree_reader_new(a->cell[0], a->cell[1]->str, a->cell[2],
+                             first, last, chunk);
+  lval_del(a);
+  return x;
+}
+
+// Creates a reader over scalar branches of a tree:
+// (tree-reader file tree {branches} [chunk [first [last]]])
+// Each call to tree-read then returns the next chunk as a table.
+lval* builtin_tree_reader(lenv* e, lval* a) {
+  return builtin_tree_reader_any(e, a, "tree-reader", 1);
+}
+
+lval* builtin_tree_read(lenv* e, lval* a) {
+  LASSERT_NUM("tree-read", a, 1);
+  LASSERT_HANDLE("tree-read", a, 0, ltree_reader, r);
+  lval* x = ltree_reader_read(r);
+  lval_del(a);
+  return x;
+}
+
+void ltree_enable_threads();
+
+// Reads ahead up to depth chunks on a background thread: (tree-prefetch r depth).
+// A depth of 0 goes back to reading on demand.
+lval* builtin_tree_prefetch(lenv* e, lval* a) {
+  LASSERT_NUM("tree-prefetch", a, 2);
+  LASSERT_HANDLE("tree-prefetch", a, 0, ltree_reader, r);
+  LASSERT_TYPE("tree-prefetch", a, 1, LVAL_NUM);
+  int depth = a->cell[1]->num;
+  lval_del(a);
+  r->StopPrefetch();
+  if (depth > 0) {
+    ltree_enable_threads();
+    r->depth = depth;
+    r->stop = false;
+    r->done = false;
+    r->prefetcher = std::thread(ltree_reader_prefetch, r);
+  }
+  return lval_sexpr();
+}
+
+// Returns {chunks read-seconds wait-seconds} for a reader: the time spent
+// reading and decompressing, and the time tree-read actually blocked.
+lval* builtin_tree_stats(lenv* e, lval* a) {
+  LASSERT_NUM("tree-stats", a, 1);
+  LASSERT_HANDLE("tree-stats", a, 0, ltree_reader, r);
+  lval* x = lval_qexpr();
+  {
+    std::lock_guard<std::mutex> guard(r->lock);
+    lval_add(x, lval_num(r->chunks));
+    lval_add(x, lval_floating(r->readTime));
+    lval_add(x, lval_floating(r->waitTime));
+  }
+  lval_del(a);
+  return x;
+}
+
+// Reads whole branches at once into a table of arrays, e.g.
+// (read-tree "data.root" events {px py} 0 1000)
+lval* builtin_read_tree(lenv* e, lval* a) {
+  lval* r = builtin_tree_reader_any(e, a, "read-tree", 0);
+  if (r->type == LVAL_ERR) { return r; }
+  ltree_reader* reader = (ltree_reader*)r->handle;
+  reader->chunk = reader->last - reader->next;
+  if (reader->chunk <= 0) { reader->chunk = 1; }
+  lval* x = ltree_reader_read(reader);
+  lval_del(r);
+  return x;
+}
+
+/* Leaf type code used in branch descriptors for an array element type */
+char larray_leaf_code(int atype) {
+  switch (atype) {
+    case kDouble_t: return 'D';
+    case kFloat_t: return 'F';
+    case kLong64_t: return 'L';
+    case kULong64_t: return 'l';
+    case kInt_t: return 'I';
+    case kUInt_t: return 'i';
+    case kShort_t: return 'S';
+    case kUShort_t: return 's';
+    case kChar_t: return 'B';
+    case kUChar_t: return 'b';
+    case kBool_t: return 'O';
+    default: return 0;
+  }
+}
+
+/* Check that table is a list of {name array} pairs of equal length and
+   return the number of rows, or an error. */
+lval* ltable_check(lval* table, long* rows) {
+  *rows = -1;
+  for (int i = 0; i < table->count; i++) {
+    lval* col = table->cell[i];
+    if (col->type != LVAL_QEXPR || col->count != 2
+        || (col->cell[0]->type != LVAL_STR && col->cell[0]->type != LVAL_SYM)
+        || col->cell[1]->type != LVAL_ARRAY) {
+      return lval_err("A table is a list of {name array} pairs.");
+    }
+    if (*rows >= 0 && col->cell[1]->length != *rows) {
+      return lval_err("Table columns have different lengths.");
+    }
+    *rows = col->cell[1]->length;
+  }
+  if (*rows < 0) { *rows = 0; }
+  return NULL;
+}
+
+const char* ltable_name(lval* table, int i) {
+  lval* name = table->cell[i]->cell[0];
+  return name->type == LVAL_STR ? name->str : name->sym;
+}
+
+/* Writer of tables into a new tree. Branches are created from the first
+   table written and every later table must have the same columns. Rows
+   are copied from the arrays into the branch slots and filled in a tight
+   loop, with the tree flushing baskets on its own AutoFlush schedule. */
+struct ltree_writer : lhandle {
+  TFile* file;
+  TTree* tree;
+  std::vector<ltree_column> columns;
+  int basket;
+  Long64_t entries;
+
+  ltree_writer() : file(NULL), tree(NULL), basket(32000), entries(0) {}
+  ~ltree_writer() { Close(); }
+  const char* Kind() const { return "tree-writer"; }
+
+  /* Write the tree and close the file, which also deletes the tree */
+  void Close() {
+    if (!file) { return; }
+    {
+      TDirectory::TContext ctx(file);
+      tree->Write("", TObject::kOverwrite);
+    }
+    delete file;
+    file = NULL;
+    tree = NULL;
+  }
+};
+
+lval* ltree_writer_new(const char* fileName, const char* name,
+                       int basket, int compression, Long64_t autoflush) {
+  ltree_writer* w = new ltree_writer();
+  lval* x = lval_handle(w);
+  w->file = lfile_open_quiet(fileName, "RECREATE");
+  if (!w->file || w->file->IsZombie()) {
+    lval_del(x);
+    return lval_err("Could not create file %s.", fileName);
+  }
+  if (compression >= 0) { w->file->SetCompressionSettings(compression); }
+  if (basket > 0) { w->basket = basket; }
+  w->tree = new TTree(name, name);
+  w->tree->SetDirectory(w->file);
+  if (autoflush) { w->tree->SetAutoFlush(autoflush); }
+  return x;
+}
+
+lval* ltree_writer_write(ltree_writer* w, lval* table) {
+  if (!w->file) { return lval_err("Tree writer is already closed."); }
+  long rows;
+  lval* err = ltable_check(table, &rows);
+  if (err) { return err; }
+
+  if (w->columns.empty()) {
+    /* First table: create the branches */
+    for (int i = 0; i < table->count; i++) {
+      ltree_column c;
+      c.name = ltable_name(table, i);
+      c.atype = table->cell[i]->cell[1]->atype;
+      c.slot = 0;
+      c.values = NULL;
+      w->columns.push_back(c);
+    }
+    for (size_t i = 0; i < w->columns.size(); i++) {
+      ltree_column& c = w->columns[i];
+      std::string leaf = c.name + "/" + larray_leaf_code(c.atype);
+      w->tree->Branch(c.name.c_str(), (void*)&c.slot, leaf.c_str(), w->basket);
+    }
+  } else {
+    bool same = (size_t)table->count == w->columns.size();
+    for (int i = 0; same && i < table->count; i++) {
+      same = w->columns[i].name == ltable_name(table, i)
+        && w->columns[i].atype == table->cell[i]->cell[1]->atype;
+    }
+    if (!same) { return lval_err("Table columns differ from the tree branches."); }
+  }
+
+  for (long k = 0; k < rows; k++) {
+    for (size_t i = 0; i < w->columns.size(); i++) {
+      ltree_column& c = w->columns[i];
+      size_t size = larray_size(c.atype);
+      memcpy(&c.slot, (char*)table->cell[i]->cell[1]->data + k * size, size);
+    }
+    if (w->tree->Fill() < 0) { return lval_err("I/O error writing entry %lli.", w->entries); }
+    w->entries++;
+  }
+  return lval_num(w->entries);
+}
+
+/* Optional basket size, compression and AutoFlush starting at argument i */
+void ltree_writer_options(lval* a, int i, int* basket, int* compression, Long64_t* autoflush) {
+  *basket = a->count > i ? a->cell[i]->num : 0;
+  *compression = a->count > i + 1 ? a->cell[i + 1]->num : -1;
+  *autoflush = a->count > i + 2 ? a->cell[i + 2]->num : 0;
+}
+
+// Creates a tree in a new file:
+// (tree-writer file tree [basket-size [compression [autoflush]]])
+// Compression uses ROOT's settings (e.g. 101 for zlib level 1) and
+// autoflush follows TTree::SetAutoFlush (entries if positive, bytes if
+// negative).
+lval* builtin_tree_writer(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 2 && a->count <= 5,
+    "Function 'tree-writer' passed %i arguments, expected 2 to 5.", a->count);
+  LASSERT_TYPE("tree-writer", a, 0, LVAL_STR);
+  LASSERT_TYPE("tree-writer", a, 1, LVAL_STR);
+  for (int i = 2; i < a->count; i++) { LASSERT_TYPE("tree-writer", a, i, LVAL_NUM); }
+  int basket, compression;
+  Long64_t autoflush;
+  ltree_writer_options(a, 2, &basket, &compression, &autoflush);
+  lval* x = ltree_writer_new(a->cell[0]->str, a->cell[1]->str,
+                             basket, compression, autoflush);
+  lval_del(a);
+  return x;
+}
+
+// Appends the rows of a table to a tree: (tree-write w table).
+// Returns the number of entries written so far.
+lval* builtin_tree_write(lenv* e, lval* a) {
+  LASSERT_NUM("tree-write", a, 2);
+  LASSERT_HANDLE("tree-write", a, 0, ltree_writer, w);
+  LASSERT_TYPE("tree-write", a, 1, LVAL_QEXPR);
+  lval* x = ltree_writer_write(w, a->cell[1]);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_tree_close(lenv* e, lval* a) {
+  LASSERT_NUM("tree-close", a, 1);
+  LASSERT_HANDLE("tree-close", a, 0, ltree_writer, w);
+  lval* x = lval_num(w->entries);
+  w->Close();
+  lval_del(a);
+  return x;
+}
+
+// Writes a table as a tree in a new file in one go:
+// (write-tree file tree table [basket-size [compression [autoflush]]])
+lval* builtin_write_tree(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 3 && a->count <= 6,
+    "Function 'write-tree' passed %i arguments, expected 3 to 6.", a->count);
+  LASSERT_TYPE("write-tree", a, 0, LVAL_STR);
+  LASSERT_TYPE("write-tree", a, 1, LVAL_STR);
+  LASSERT_TYPE("write-tree", a, 2, LVAL_QEXPR);
+  for (int i = 3; i < a->count; i++) { LASSERT_TYPE("write-tree", a, i, LVAL_NUM); }
+  int basket, compression;
+  Long64_t autoflush;
+  ltree_writer_options(a, 3, &basket, &compression, &autoflush);
+  lval* w = ltree_writer_new(a->cell[0]->str, a->cell[1]->str,
+                             basket, compression, autoflush);
+  if (w->type == LVAL_ERR) { lval_del(a); return w; }
+  lval* x = ltree_writer_write((ltree_writer*)w->handle, a->cell[2]);
+  lval_del(w);
+  lval_del(a);
+  return x;
+}
+
+/* Copy of v that shares no mutable state with it: arrays are copied and
+   objects cloned, so that every tree-fold worker has its own. Done on the
+   main thread, as cloning may go through the interpreter. */
+lval* lval_detach(lval* v) {
+  switch (v->type) {
+    case LVAL_QEXPR: {
+      lval* x = lval_qexpr();
+      for (int i = 0; i < v->count; i++) { lval_add(x, lval_detach(v->cell[i])); }
+      return x;
+    }
+    case LVAL_ARRAY: {
+      lval* x = lval_array(v->length, v->atype);
+      if (x->type == LVAL_ARRAY) {
+        memcpy(x->data, v->data, v->length * larray_size(v->atype));
+      }
+      return x;
+    }
+    case LVAL_TOBJ:
+      if (v->obj && !lval_deleted(v)) {
+        TObject* obj = v->obj->Clone();
+        if (obj->InheritsFrom(TH1::Class())) { ((TH1*)obj)->SetDirectory(NULL); }
+        return lval_tobj_owned(obj);
+      }
+      return lval_copy(v);
+    default:
+      return lval_copy(v);
+  }
+}
+
+/* Add the partial result y into x, where both come from the same initial
+   value: numbers are summed, arrays added element by element, histograms
+   added with TH1::Add and lists merged item by item. Anything else must
+   be equal. Returns an error, or NULL on success. */
+lval* lval_merge(lval* x, lval* y) {
+  if ((x->type == LVAL_NUM || x->type == LVAL_FLOAT)
+      && (y->type == LVAL_NUM || y->type == LVAL_FLOAT)) {
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+      x->num += y->num;
+    } else {
+      x->floating = lval_to_double(x) + lval_to_double(y);
+      x->type = LVAL_FLOAT;
+    }
+    return NULL;
+  }
+  if (x->type != y->type) {
+    return lval_err("Cannot merge %s with %s.",
+      ltype_name(x->type), ltype_name(y->type));
+  }
+  switch (x->type) {
+    case LVAL_ARRAY:
+      if (x->readonly) {
+        return lval_err("Cannot merge into a read-only array view.");
+      }
+      if (x->length != y->length) {
+        return lval_err("Cannot merge arrays of different lengths.");
+      }
+#define AXPY(T) larray_axpy((T*)x->data, y, 1.)
+      LARRAY_SWITCH(x->atype, AXPY)
+#undef AXPY
+      return NULL;
+    case LVAL_TOBJ:
+      if (x->obj && y->obj && x->obj->InheritsFrom(TH1::Class())
+          && y->obj->InheritsFrom(TH1::Class())) {
+        ((TH1*)x->obj)->Add((TH1*)y->obj);
+        return NULL;
+      }
+      if (x->obj == y->obj) { return NULL; }
+      return lval_err("Cannot merge objects of class %s.",
+        x->obj ? x->obj->ClassName() : "(null)");
+    case LVAL_QEXPR:
+      if (x->count != y->count) {
+        return lval_err("Cannot merge lists of different lengths.");
+      }
+      for (int i = 0; i < x->count; i++) {
+        lval* err = lval_merge(x->cell[i], y->cell[i]);
+        if (err) { return err; }
+      }
+      return NULL;
+    default:
+      if (lval_eq(x, y)) { return NULL; }
+      return lval_err("Cannot merge differing values of type %s.",
+        ltype_name(x->type));
+  }
+}
+
+/* Copy of a global binding for a tree-fold worker. Workers run at the
+   same time on values shared with the main thread, so anything pointing
+   to a ROOT object or a handle, directly or inside a list or a lambda, is
+   replaced by an error naming the binding, and arrays are copied. */
+lval* lval_worker_copy(lval* v, const char* name) {
+  switch (v->type) {
+    case LVAL_TOBJ:
+    case LVAL_SEQ:
+    case LVAL_HANDLE:
+    case LVAL_TMETHOD:
+      return lval_err("%s refers to a %s, which a tree-fold function "
+                      "cannot use. Pass objects in the initial value instead.",
+                      name, ltype_name(v->type));
+    case LVAL_ARRAY:
+      return lval_detach(v);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR: {
+      lval* x = v->type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+      for (int i = 0; i < v->count; i++) {
+        lval* y = lval_worker_copy(v->cell[i], name);
+        if (y->type == LVAL_ERR && v->cell[i]->type != LVAL_ERR) {
+          lval_del(x);
+          return y;
+        }
+        lval_add(x, y);
+      }
+      return x;
+    }
+    case LVAL_FUN: {
+      lval* x = lval_copy(v);
+      if (v->builtin) { return x; }
+      /* Partially applied arguments */
+      for (int i = 0; i < x->env->count; i++) {
+        lval* y = lval_worker_copy(x->env->vals[i], name);
+        if (y->type == LVAL_ERR && x->env->vals[i]->type != LVAL_ERR) {
+          lval_del(x);
+          return y;
+        }
+        lval_del(x->env->vals[i]);
+        x->env->vals[i] = y;
+      }
+      return x;
+    }
+    default:
+      return lval_copy(v);
+  }
+}
+
+lenv* lenv_worker_copy(lenv* e) {
+  lenv* n = lenv_copy(e);
+  for (int i = 0; i < n->count; i++) {
+    std::string name = std::string("'") + e->syms[i] + "'";
+    lval* y = lval_worker_copy(e->vals[i], name.c_str());
+    lval_del(n->vals[i]);
+    n->vals[i] = y;
+  }
+  return n;
+}
+
+/* One worker of tree-fold: a range of entries, read through its own
+   file and tree, folded into its own accumulator with its own copy of
+   the function and of the global environment. */
+struct ltree_fold_job {
+  lval* source;
+  const char* name;
+  lval* branches;
+  long chunk;
+  Long64_t first;
+  Long64_t last;
+  lenv* env;
+  lval* f;
+  lval* acc;
+};
+
+void ltree_fold_work(ltree_fold_job* j) {
+  lworker = true;
+  lval* reader = ltree_reader_new(j->source, j->name, j->branches,
+                                  j->first, j->last, j->chunk);
+  if (reader->type == LVAL_ERR) {
+    lval_del(j->acc);
+    j->acc = reader;
+    return;
+  }
+  ltree_reader* r = (ltree_reader*)reader->handle;
+  while (j->acc->type != LVAL_ERR) {
+    lval* t = ltree_reader_read(r);
+    if (t->type == LVAL_ERR) { lval_del(j->acc); j->acc = t; break; }
+    if (t->count == 0) { lval_del(t); break; }
+    j->acc = lval_apply(j->env, j->f, j->acc, t);
+  }
+  {
+    /* Closing the file goes through gDirectory as well */
+    std::lock_guard<std::mutex> guard(lglobal_mutex);
+    TDirectory::TContext ctx(gDirectory);
+    lval_del(reader);
+  }
+  lworker = false;
+}
+
+/* Detaches the histograms of a worker's result from whatever directory
+   they were created in, before they are merged on the main thread */
+void ltree_fold_detach(lval* v) {
+  if (v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) { ltree_fold_detach(v->cell[i]); }
+  } else if (v->type == LVAL_TOBJ && v->obj && v->obj->InheritsFrom(TH1::Class())) {
+    ((TH1*)v->obj)->SetDirectory(NULL);
+  }
+}
+
+/* ROOT has to be told once that it will be used from several threads */
+void ltree_enable_threads() {
+  static bool done = false;
+  if (done) { return; }
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,0,0)
+  ROOT::EnableThreadSafety();
+#else
+  TThread::Initialize();
+#endif
+  done = true;
+}
+
+// Folds the chunks of a tree in parallel:
+// (tree-fold file tree {branches} f init [threads [chunk]])
+// file is a file name or a list of them to be chained. The entries are
+// split into one contiguous range per thread and each thread computes
+// (f acc chunk) over its chunks, starting from its own copy of init.
+// The partial results are then merged, see lval_merge.
+lval* builtin_tree_fold(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 5 && a->count <= 7,
+    "Function 'tree-fold' passed %i arguments, expected 5 to 7.", a->count);
+  LASSERT(a, a->cell[0]->type == LVAL_STR || a->cell[0]->type == LVAL_QEXPR,
+    "Function 'tree-fold' needs a file name or a list of them.");
+  LASSERT_TYPE("tree-fold", a, 1, LVAL_STR);
+  LASSERT_TYPE("tree-fold", a, 2, LVAL_QEXPR);
+  LASSERT_TYPE("tree-fold", a, 3, LVAL_FUN);
+  for (int i = 5; i < a->count; i++) { LASSERT_TYPE("tree-fold", a, i, LVAL_NUM); }
+
+  int threads = a->count > 5 ? a->cell[5]->num : std::thread::hardware_concurrency();
+  long chunk = a->count > 6 ? a->cell[6]->num : 0;
+  if (threads < 1) { threads = 1; }
+
+  /* Check the branches and count the entries once up front, so that
+     mistakes are reported before any thread starts. */
+  lval* probe = ltree_reader_new(a->cell[0], a->cell[1]->str, a->cell[2], 0, -1, 1);
+  if (probe->type == LVAL_ERR) { lval_del(a); return probe; }
+  Long64_t entries = ((ltree_reader*)probe->handle)->last;
+  lval_del(probe);
+  if (entries < threads) { threads = entries > 0 ? entries : 1; }
+
+  lval* f = lval_worker_copy(a->cell[3], "The fold function");
+  if (f->type == LVAL_ERR) { lval_del(a); return f; }
+
+  lenv* top = e;
+  while (top->par) { top = top->par; }
+  ltree_enable_threads();
+
+  std::vector<ltree_fold_job> jobs(threads);
+  for (int w = 0; w < threads; w++) {
+    ltree_fold_job& j = jobs[w];
+    j.source = a->cell[0];
+    j.name = a->cell[1]->str;
+    j.branches = a->cell[2];
+    j.chunk = chunk;
+    j.first = entries * w / threads;
+    j.last = entries * (w + 1) / threads;
+    j.env = lenv_worker_copy(top);
+    j.f = lval_copy(f);
+    j.acc = lval_detach(a->cell[4]);
+  }
+
+  std::vector<std::thread> pool;
+  for (int w = 1; w < threads; w++) {
+    pool.push_back(std::thread(ltree_fold_work, &jobs[w]));
+  }
+  ltree_fold_work(&jobs[0]);
+  for (size_t i = 0; i < pool.size(); i++) { pool[i].join(); }
+  lobj_release_deferred();
+
+  lval* x = NULL;
+  for (int w = 0; w < threads; w++) {
+    ltree_fold_job& j = jobs[w];
+    ltree_fold_detach(j.acc);
+    if (!x) {
+      x = j.acc;
+    } else if (x->type != LVAL_ERR) {
+      lval* err = j.acc->type == LVAL_ERR ? lval_copy(j.acc) : lval_merge(x, j.acc);
+      if (err) { lval_del(x); x = err; }
+      lval_del(j.acc);
+    } else {
+      lval_del(j.acc);
+    }
+    lval_del(j.f);
+    lenv_del(j.env);
+  }
+  lobj_release_deferred();
+  lredraw_touch_value(x);
+  lval_del(f);
+  lval_del(a);
+  return x;
+}
+
+/* Dataflow queries. 'dataframe' starts a lazy graph over a tree which is
+   extended with df-define and df-filter and on which results are booked
+   with df-histo1d and df-count. Nothing is read until the first result is
+   asked for with df-get, at which point all results booked so far are
+   computed in a single event loop: by RDataFrame, with implicit
+   multithreading, where available, and by TTreeFormula otherwise. */
+struct ldf_step {
+  bool filter;
+  std::string name;   /* column defined, for a define */
+  std::string expr;
+};
+
+enum { LDF_HISTO1D, LDF_COUNT };
+
+struct ldf_booking {
+  std::vector<ldf_step> steps;
+  int kind;
+  std::string column;
+  std::string hname;
+  int nbins;
+  double lo;
+  double hi;
+  lval* value;        /* set once computed */
+};
+
+struct ldf_graph {
+  std::string file;
+  std::string tree;
+  int threads;
+  std::vector<ldf_booking*> bookings;
+
+  ~ldf_graph() {
+    for (size_t i = 0; i < bookings.size(); i++) {
+      if (bookings[i]->value) { lval_del(bookings[i]->value); }
+      delete bookings[i];
+    }
+  }
+};
+
+/* A node of the graph, i.e. the steps leading to it */
+struct ldf_frame : lhandle {
+  std::shared_ptr<ldf_graph> graph;
+  std::vector<ldf_step> steps;
+  const char* Kind() const { return "dataframe"; }
+};
+
+struct ldf_result : lhandle {
+  std::shared_ptr<ldf_graph> graph;
+  ldf_booking* booking;
+  const char* Kind() const { return "dataframe-result"; }
+};
+
+/* Translation of numeric lambdas into expressions for the JIT. Lambda
+   arguments name columns, and only arithmetic, comparisons, and, or, not,
+   if, min, max and a few math functions are understood. Any other symbol
+   makes the lambda untranslatable, rather than reaching the C++ code. */
+bool ldf_cexpr(lval* v, lval* formals, std::string& out);
+
+bool ldf_cbody(lval* body, lval* formals, std::string& out) {
+  if (body->count == 1) { return ldf_cexpr(body->cell[0], formals, out); }
+  lval* call = lval_copy(body);
+  call->type = LVAL_SEXPR;
+  bool ok = ldf_cexpr(call, formals, out);
+  lval_del(call);
+  return ok;
+}
+
+bool ldf_is_formal(lval* formals, const char* sym) {
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->type == LVAL_SYM
+        && strcmp(formals->cell[i]->sym, sym) == 0
+        && strcmp(sym, "&") != 0) { return true; }
+  }
+  return false;
+}
+
+/* c ? a : b, which TTreeFormula spells arithmetically */
+std::string ldf_cif(const std::string& c, const std::string& a, const std::string& b) {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,16,0)
+  return "((" + c + ")?(" + a + "):(" + b + "))";
+#else
+  return "((" + c + ")!=0)*(" + a + ")+((" + c + ")==0)*(" + b + ")";
+#endif
+}
+
+bool ldf_cexpr(lval* v, lval* formals, std::string& out) {
+  char buf[64];
+  switch (v->type) {
+    case LVAL_NUM:
+      snprintf(buf, sizeof(buf), "%ld", v->num);
+      out = buf;
+      return true;
+    case LVAL_FLOAT:
+      snprintf(buf, sizeof(buf), "%.17g", v->floating);
+      out = buf;
+      if (!strpbrk(buf, ".en")) { out += ".0"; }
+      return true;
+    case LVAL_SYM:
+      if (!ldf_is_formal(formals, v->sym)) { return false; }
+      out = v->sym;
+      return true;
+    case LVAL_SEXPR:
+      break;
+    default:
+      return false;
+  }
+  if (v->count < 2 || v->cell[0]->type != LVAL_SYM) { return false; }
+  std::string op = v->cell[0]->sym;
+  int n = v->count - 1;
+  std::vector<std::string> args(n);
+  for (int i = 0; i < n; i++) {
+    lval* x = v->cell[i + 1];
+    bool ok = x->type == LVAL_QEXPR ? ldf_cbody(x, formals, args[i])
+                                    : ldf_cexpr(x, formals, args[i]);
+    if (!ok) { return false; }
+  }
+
+  static const char* infix[] = { "+", "-", "*", "/", 0 };
+  static const char* compare[] = { "==", "!=", ">", "<", ">=", "<=", 0 };
+  static const char* math[][2] = {
+    { "sqrt", "sqrt" }, { "exp", "exp" }, { "log", "log" },
+    { "sin", "sin" }, { "cos", "cos" }, { "tan", "tan" },
+    { "atan2", "atan2" }, { "pow", "pow" },
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,16,0)
+    { "abs", "std::abs" },
+#else
+    { "abs", "abs" },
+#endif
+    { 0, 0 }
+  };
+
+  if (op == "-" && n == 1) { out = "(-" + args[0] + ")"; return true; }
+  for (int i = 0; infix[i]; i++) {
+    if (op != infix[i]) { continue; }
+    out = "(" + args[0];
+    for (int k = 1; k < n; k++) { out += op + args[k]; }
+    out += ")";
+    return true;
+  }
+  for (int i = 0; compare[i]; i++) {
+    if (op != compare[i] || n != 2) { continue; }
+    out = "(" + args[0] + op + args[1] + ")";
+    return true;
+  }
+  if ((op == "and" || op == "or") && n == 2) {
+    out = "(" + args[0] + (op == "and" ? "&&" : "||") + args[1] + ")";
+    return true;
+  }
+  if (op == "not" && n == 1) { out = "(!" + args[0] + ")"; return true; }
+  if (op == "if" && n == 3) { out = ldf_cif(args[0], args[1], args[2]); return true; }
+  if (op == "min" || op == "max") {
+    out = args[0];
+    for (int k = 1; k < n; k++) {
+      std::string c = "(" + args[k] + (op == "min" ? "<" : ">") + out + ")";
+      out = ldf_cif(c, args[k], out);
+    }
+    return true;
+  }
+  for (int i = 0; math[i][0]; i++) {
+    if (op != math[i][0]) { continue; }
+    out = std::string(math[i][1]) + "(" + args[0];
+    for (int k = 1; k < n; k++) { out += "," + args[k]; }
+    out += ")";
+    return true;
+  }
+  return false;
+}
+
+/* An expression given either as a string of C++ or as a lambda */
+lval* ldf_expr(const char* what, lval* x, std::string& out) {
+  if (x->type == LVAL_STR) { out = x->str; return NULL; }
+  if (x->type == LVAL_FUN && !x->builtin
+      && ldf_cbody(x->body, x->formals, out)) { return NULL; }
+  return lval_err("Function '%s' needs a string or a numeric lambda "
+    "it can translate to C++.", what);
+}
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,16,0)
+/* The RDataFrame node for a list of steps, sharing common prefixes so
+   that every define and filter is evaluated once per entry */
+ROOT::RDF::RNode ldf_node(std::map<std::string, ROOT::RDF::RNode>& nodes,
+                          const std::vector<ldf_step>& steps) {
+  std::string key;
+  ROOT::RDF::RNode node = nodes.find(key)->second;
+  for (size_t i = 0; i < steps.size(); i++) {
+    const ldf_step& s = steps[i];
+    key += (s.filter ? "F " : "D " + s.name + " ") + s.expr + ";";
+    std::map<std::string, ROOT::RDF::RNode>::iterator it = nodes.find(key);
+    if (it == nodes.end()) {
+      ROOT::RDF::RNode next = s.filter ? ROOT::RDF::RNode(node.Filter(s.expr))
+                                       : ROOT::RDF::RNode(node.Define(s.name, s.expr));
+      it = nodes.insert(std::make_pair(key, next)).first;
+    }
+    node = it->second;
+  }
+  return node;
+}
+
+lval* ldf_run_loop(ldf_graph* g, std::vector<ldf_booking*>& todo) {
+  try {
+    ROOT::RDataFrame df(g->tree, g->file);
+    std::map<std::string, ROOT::RDF::RNode> nodes;
+    nodes.insert(std::make_pair(std::string(), ROOT::RDF::RNode(df)));
+    std::vector<ROOT::RDF::RResultPtr<TH1D> > histos(todo.size());
+    std::vector<ROOT::RDF::RResultPtr<ULong64_t> > counts(todo.size());
+    for (size_t i = 0; i < todo.size(); i++) {
+      ldf_booking* b = todo[i];
+      ROOT::RDF::RNode node = ldf_node(nodes, b->steps);
+      if (b->kind == LDF_HISTO1D) {
+        histos[i] = node.Histo1D(ROOT::RDF::TH1DModel(b->hname.c_str(), b->column.c_str(),
+                                                     b->nbins, b->lo, b->hi), b->column);
+      } else {
+        counts[i] = node.Count();
+      }
+    }
+    /* Reading one result runs the loop for all of them */
+    for (size_t i = 0; i < todo.size(); i++) {
+      ldf_booking* b = todo[i];
+      if (b->kind == LDF_HISTO1D) {
+        TH1D* h = (TH1D*)histos[i]->Clone();
+        h->SetDirectory(NULL);
+        b->value = lval_tobj_owned(h);
+      } else {
+        b->value = lval_num(*counts[i]);
+      }
+    }
+  } catch (const std::exception& ex) {
+    return lval_err("RDataFrame: %s", ex.what());
+  }
+  return NULL;
+}
+
+/* Implicit multi-threading is process wide, so it is only on during the
+   loop, unless the script had turned it on itself */
+lval* ldf_run(ldf_graph* g, std::vector<ldf_booking*>& todo) {
+  bool was_mt = ROOT::IsImplicitMTEnabled();
+  if (g->threads != 1 && !was_mt) { ROOT::EnableImplicitMT(g->threads > 1 ? g->threads : 0); }
+  lval* err = ldf_run_loop(g, todo);
+  if (!was_mt && ROOT::IsImplicitMTEnabled()) { ROOT::DisableImplicitMT(); }
+  return err;
+}
+#else
+/* Without RDataFrame the graph runs on TTreeFormula: defines become tree
+   aliases and each distinct cut is compiled and evaluated once per entry,
+   whatever the number of results depending on it. */
+lval* ldf_run(ldf_graph* g, std::vector<ldf_booking*>& todo) {
+  TFile* file = lfile_open_quiet(g->file.c_str());
+  if (!file || file->IsZombie()) {
+    delete file;
+    return lval_err("Could not open file %s.", g->file.c_str());
+  }
+  TObject* obj = file->Get(g->tree.c_str());
+  TTree* tree = obj && obj->InheritsFrom(TTree::Class()) ? (TTree*)obj : NULL;
+  if (!tree) {
+    delete file;
+    return lval_err("No tree called %s.", g->tree.c_str());
+  }
+
+  lval* err = NULL;
+  std::map<std::string, std::string> aliases;
+  std::map<std::string, int> cutIndex;
+  std::vector<TTreeFormula*> cuts;
+  std::vector<int> cutOf(todo.size(), -1);
+  std::vector<TTreeFormula*> vars(todo.size(), (TTreeFormula*)NULL);
+  std::vector<TH1D*> histos(todo.size(), (TH1D*)NULL);
+  std::vector<Long64_t> counts(todo.size(), 0);
+
+  for (size_t i = 0; i < todo.size() && !err; i++) {
+    ldf_booking* b = todo[i];
+    std::string cut;
+    for (size_t k = 0; k < b->steps.size() && !err; k++) {
+      const ldf_step& s = b->steps[k];
+      if (s.filter) {
+        cut += (cut.empty() ? "(" : "&&(") + s.expr + ")";
+        continue;
+      }
+      std::map<std::string, std::string>::iterator it = aliases.find(s.name);
+      if (it != aliases.end() && it->second != s.expr) {
+        err = lval_err("Column %s is defined differently in two branches "
+          "of the query.", s.name.c_str());
+      } else if (it == aliases.end()) {
+        aliases[s.name] = s.expr;
+        tree->SetAlias(s.name.c_str(), s.expr.c_str());
+      }
+    }
+    if (err) { break; }
+    if (!cut.empty()) {
+      if (!cutIndex.count(cut)) {
+        cutIndex[cut] = cuts.size();
+        cuts.push_back(new TTreeFormula("cut", cut.c_str(), tree));
+        if (cuts.back()->GetNdim() == 0) {
+          err = lval_err("Cannot compile filter %s.", cut.c_str());
+        }
+      }
+      cutOf[i] = cutIndex[cut];
+    }
+    if (b->kind == LDF_HISTO1D && !err) {
+      vars[i] = new TTreeFormula("var", b->column.c_str(), tree);
+      if (vars[i]->GetNdim() == 0) {
+        err = lval_err("Cannot compile column %s.", b->column.c_str());
+      }
+      histos[i] = new TH1D(b->hname.c_str(), b->column.c_str(), b->nbins, b->lo, b->hi);
+      histos[i]->SetDirectory(NULL);
+    }
+  }
+
+  std::vector<char> pass(cuts.size());
+  Long64_t entries = err ? 0 : tree->GetEntries();
+  for (Long64_t n = 0; n < entries; n++) {
+    if (tree->LoadTree(n) < 0) { break; }
+    for (size_t c = 0; c < cuts.size(); c++) {
+      pass[c] = cuts[c]->GetNdata() > 0 && cuts[c]->EvalInstance(0) != 0;
+    }
+    for (size_t i = 0; i < todo.size(); i++) {
+      if (cutOf[i] >= 0 && !pass[cutOf[i]]) { continue; }
+      counts[i]++;
+      if (vars[i] && vars[i]->GetNdata() > 0) { histos[i]->Fill(vars[i]->EvalInstance(0)); }
+    }
+  }
+
+  for (size_t i = 0; i < todo.size(); i++) {
+    delete vars[i];
+    if (err) { delete histos[i]; continue; }
+    todo[i]->value = histos[i] ? lval_tobj_owned(histos[i]) : lval_num(counts[i]);
+  }
+  for (size_t c = 0; c < cuts.size(); c++) { delete cuts[c]; }
+  delete file;
+  return err;
+}
+#endif
+
+// Starts a query over a tree: (dataframe file tree [threads]).
+// threads is the number of threads of the event loop, 0 for all cores.
+lval* builtin_dataframe(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'dataframe' passed %i arguments, expected 2 or 3.", a->count);
+  LASSERT_TYPE("dataframe", a, 0, LVAL_STR);
+  LASSERT_TYPE("dataframe", a, 1, LVAL_STR);
+  if (a->count == 3) { LASSERT_TYPE("dataframe", a, 2, LVAL_NUM); }
+  ldf_frame* f = new ldf_frame();
+  f->graph = std::make_shared<ldf_graph>();
+  f->graph->file = a->cell[0]->str;
+  f->graph->tree = a->cell[1]->str;
+  f->graph->threads = a->count == 3 ? a->cell[2]->num : 0;
+  lval_del(a);
+  return lval_handle(f);
+}
+
+/* A new node extending frame with one step */
+lval* ldf_extend(ldf_frame* frame, bool filter, const std::string& name,
+                 const std::string& expr) {
+  ldf_frame* f = new ldf_frame();
+  f->graph = frame->graph;
+  f->steps = frame->steps;
+  ldf_step s;
+  s.filter = filter;
+  s.name = name;
+  s.expr = expr;
+  f->steps.push_back(s);
+  return lval_handle(f);
+}
+
+// Adds a column: (df-define df name expr), e.g.
+// (df-define df "pt" (\ {px py} {sqrt (+ (* px px) (* py py))}))
+lval* builtin_df_define(lenv* e, lval* a) {
+  LASSERT_NUM("df-define", a, 3);
+  LASSERT_HANDLE("df-define", a, 0, ldf_frame, f);
+  LASSERT_TYPE("df-define", a, 1, LVAL_STR);
+  std::string expr;
+  lval* err = ldf_expr("df-define", a->cell[2], expr);
+  if (err) { lval_del(a); return err; }
+  lval* x = ldf_extend(f, false, a->cell[1]->str, expr);
+  lval_del(a);
+  return x;
+}
+
+// Keeps the entries passing a cut: (df-filter df expr).
+lval* builtin_df_filter(lenv* e, lval* a) {
+  LASSERT_NUM("df-filter", a, 2);
+  LASSERT_HANDLE("df-filter", a, 0, ldf_frame, f);
+  std::string expr;
+  lval* err = ldf_expr("df-filter", a->cell[1], expr);
+  if (err) { lval_del(a); return err; }
+  lval* x = ldf_extend(f, true, "", expr);
+  lval_del(a);
+  return x;
+}
+
+lval* ldf_book(ldf_frame* f, int kind) {
+  ldf_booking* b = new ldf_booking();
+  b->steps = f->steps;
+  b->kind = kind;
+  b->nbins = 0;
+  b->lo = b->hi = 0;
+  b->value = NULL;
+  f->graph->bookings.push_back(b);
+  ldf_result* r = new ldf_result();
+  r->graph = f->graph;
+  r->booking = b;
+  return lval_handle(r);
+}
+
+// Books a histogram of a column: (df-histo1d df name column nbins lo hi).
+lval* builtin_df_histo1d(lenv* e, lval* a) {
+  LASSERT_NUM("df-histo1d", a, 6);
+  LASSERT_HANDLE("df-histo1d", a, 0, ldf_frame, f);
+  LASSERT_TYPE("df-histo1d", a, 1, LVAL_STR);
+  LASSERT_TYPE("df-histo1d", a, 2, LVAL_STR);
+  LASSERT_TYPE("df-histo1d", a, 3, LVAL_NUM);
+  LASSERT_NUMERIC("df-histo1d", a, 4);
+  LASSERT_NUMERIC("df-histo1d", a, 5);
+  lval* x = ldf_book(f, LDF_HISTO1D);
+  ldf_booking* b = ((ldf_result*)x->handle)->booking;
+  b->hname = a->cell[1]->str;
+  b->column = a->cell[2]->str;
+  b->nbins = a->cell[3]->num;
+  b->lo = lval_to_double(a->cell[4]);
+  b->hi = lval_to_double(a->cell[5]);
+  lval_del(a);
+  return x;
+}
+
+// Books the number of entries passing the filters: (df-count df).
+lval* builtin_df_count(lenv* e, lval* a) {
+  LASSERT_NUM("df-count", a, 1);
+  LASSERT_HANDLE("df-count", a, 0, ldf_frame, f);
+  lval* x = ldf_book(f, LDF_COUNT);
+  lval_del(a);
+  return x;
+}
+
+// Returns a booked result, running the event loop if needed: (df-get r).
+lval* builtin_df_get(lenv* e, lval* a) {
+  LASSERT_NUM("df-get", a, 1);
+  LASSERT_HANDLE("df-get", a, 0, ldf_result, r);
+  if (!r->booking->value) {
+    std::vector<ldf_booking*> todo;
+    for (size_t i = 0; i < r->graph->bookings.size(); i++) {
+      if (!r->graph->bookings[i]->value) { todo.push_back(r->graph->bookings[i]); }
+    }
+    lval* err = ldf_run(r->graph.get(), todo);
+    if (err) { lval_del(a); return err; }
+  }
+  lval* x = lval_copy(r->booking->value);
+  lval_del(a);
+  return x;
+}
+
+/* Files opened with open-file. On open, the keys of the file and of all
+   its subdirectories are indexed by path in a hash table, and objects read
+   through file-get are kept in a cache bounded by their uncompressed size,
+   from which the least recently used are dropped first. A file opened
+   again while the first handle is alive gets that same handle. */
+#define LFILE_CACHE_BYTES (64L << 20)
+
+struct lfile_entry {
+  lval* obj;
+  long bytes;
+  std::list<std::string>::iterator lru;
+};
+
+struct lfile;
+
+/* Files currently open, by path */
+std::map<std::string, lfile*> lfile_open;
+
+struct lfile : lhandle {
+  std::string path;
+  lval* file;     /* owned TFile, kept alive by objects that live in it */
+  std::unordered_map<std::string, TKey*> keys;
+  std::unordered_map<std::string, lfile_entry> cache;
+  std::list<std::string> lru;   /* most recently used first */
+  long budget;
+  long used;
+  long hits;
+  long misses;
+
+  lfile() : file(NULL), budget(LFILE_CACHE_BYTES), used(0), hits(0), misses(0) {}
+  ~lfile() {
+    Evict(0);
+    if (file) { lval_del(file); }
+    lfile_open.erase(path);
+  }
+  const char* Kind() const { return "file"; }
+
+  /* Drop the least recently used objects until at most limit bytes are held */
+  void Evict(long limit) {
+    while (used > limit && !lru.empty()) {
+      std::unordered_map<std::string, lfile_entry>::iterator it = cache.find(lru.back());
+      used -= it->second.bytes;
+      lval_del(it->second.obj);
+      cache.erase(it);
+      lru.pop_back();
+    }
+  }
+};
+
+/* Index the keys of dir under prefix, keeping the highest cycle of each */
+void lfile_index(std::unordered_map<std::string, TKey*>& keys, TDirectory* dir,
+                 const std::string& prefix) {
+  TIter next(dir->GetListOfKeys());
+  while (TKey* key = (TKey*)next()) {
+    std::string name = prefix + key->GetName();
+    std::unordered_map<std::string, TKey*>::iterator it = keys.find(name);
+    if (it != keys.end() && it->second->GetCycle() >= key->GetCycle()) { continue; }
+    keys[name] = key;
+    TClass* cls = TClass::GetClass(key->GetClassName());
+    if (cls && cls->InheritsFrom(TDirectory::Class())) {
+      TDirectory* sub = dir->GetDirectory(key->GetName());
+      if (sub) { lfile_index(keys, sub, name + "/"); }
+    }
+  }
+}
+
+/* A copy of an object read from a file that the script can modify
+   without changing what the cache holds, see file-get-copy. Directories
+   and trees belong to the file and are shared. */
+lval* lfile_clone(lval* x) {
+  TObject* obj = x->type == LVAL_TOBJ ? x->obj : NULL;
+  if (!obj || obj->InheritsFrom(TDirectory::Class())
+      || obj->InheritsFrom(TTree::Class())) { return lval_copy(x); }
+  TObject* c = obj->Clone();
+  if (c->InheritsFrom(TH1::Class())) { ((TH1*)c)->SetDirectory(NULL); }
+  return lval_tobj_owned(c);
+}
+
+/* Read the object at path, from the cache if possible. Callers share
+   the object the cache holds, unless they ask for a copy of their own. */
+lval* lfile_get(lfile* f, const char* path, bool copy) {
+  std::unordered_map<std::string, lfile_entry>::iterator hit = f->cache.find(path);
+  if (hit != f->cache.end()) {
+    f->hits++;
+    f->lru.splice(f->lru.begin(), f->lru, hit->second.lru);
+    return copy ? lfile_clone(hit->second.obj) : lval_copy(hit->second.obj);
+  }
+  std::unordered_map<std::string, TKey*>::iterator it = f->keys.find(path);
+  if (it == f->keys.end()) {
+    return lval_err("No object called %s in %s.", path, f->path.c_str());
+  }
+  f->misses++;
+  TKey* key = it->second;
+  TFile* file = (TFile*)f->file->obj;
+
+  /* Directories and trees stay with the file, histograms are detached
+     from it and, like any other object read, belong to us. */
+  lval* x;
+  TClass* cls = TClass::GetClass(key->GetClassName());
+  if (cls && cls->InheritsFrom(TDirectory::Class())) {
+    x = lval_tobj_shared(file->GetDirectory(path), f->file->ref);
+  } else {
+    TObject* obj = key->ReadObj();
+    if (!obj) { return lval_err("Could not read %s from %s.", path, f->path.c_str()); }
+    if (obj->InheritsFrom(TTree::Class())) {
+      x = lval_tobj_shared(obj, f->file->ref);
+    } else {
+      if (obj->InheritsFrom(TH1::Class())) { ((TH1*)obj)->SetDirectory(NULL); }
+      x = lval_tobj_owned(obj);
+    }
+  }
+
+  long bytes = key->GetObjlen();
+  if (bytes <= f->budget) {
+    f->Evict(f->budget - bytes);
+    f->lru.push_front(path);
+    lfile_entry entry = { copy ? lfile_clone(x) : lval_copy(x), bytes, f->lru.begin() };
+    f->cache[path] = entry;
+    f->used += bytes;
+  }
+  return x;
+}
+
+// Opens a file for reading with an index of its keys and an object cache:
+// (open-file path [cache-bytes]). Opening a file which is already open
+// returns the same handle.
+lval* builtin_open_file(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'open-file' passed %i arguments, expected 1 or 2.", a->count);
+  LASSERT_TYPE("open-file", a, 0, LVAL_STR);
+  if (a->count == 2) { LASSERT_TYPE("open-file", a, 1, LVAL_NUM); }
+  std::string path = a->cell[0]->str;
+  long budget = a->count == 2 ? a->cell[1]->num : -1;
+  lval_del(a);
+
+  std::map<std::string, lfile*>::iterator open = lfile_open.find(path);
+  if (open != lfile_open.end()) {
+    if (budget >= 0) {
+      open->second->budget = budget;
+      open->second->Evict(budget);
+    }
+    return lval_handle(open->second);
+  }
+
+  TFile* file = lfile_open_quiet(path.c_str());
+  if (!file || file->IsZombie()) {
+    delete file;
+    return lval_err("Could not open file %s.", path.c_str());
+  }
+  lfile* f = new lfile();
+  f->path = path;
+  f->file = lval_tobj_owned(file);
+  if (budget >= 0) { f->budget = budget; }
+  lfile_index(f->keys, file, "");
+  lfile_open[path] = f;
+  return lval_handle(f);
+}
+
+/* Seek position of a name, for sorting bulk reads */
+struct lfile_by_seek {
+  lfile* f;
+  bool operator()(const std::string& x, const std::string& y) const {
+    std::unordered_map<std::string, TKey*>::iterator kx = f->keys.find(x);
+    std::unordered_map<std::string, TKey*>::iterator ky = f->keys.find(y);
+    Long64_t sx = kx == f->keys.end() ? 0 : kx->second->GetSeekKey();
+    Long64_t sy = ky == f->keys.end() ? 0 : ky->second->GetSeekKey();
+    return sx < sy;
+  }
+};
+
+/* Shared argument handling of file-get and file-get-copy */
+lval* builtin_file_get_any(lenv* e, lval* a, const char* func, bool copy) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_HANDLE(func, a, 0, lfile, f);
+  LASSERT(a, a->cell[1]->type == LVAL_STR || a->cell[1]->type == LVAL_QEXPR,
+    "Function '%s' needs a name or a list of names.", func);
+  if (a->cell[1]->type == LVAL_STR) {
+    lval* x = lfile_get(f, a->cell[1]->str, copy);
+    lval_del(a);
+    return x;
+  }
+
+  lval* names = a->cell[1];
+  for (int i = 0; i < names->count; i++) {
+    LASSERT(a, names->cell[i]->type == LVAL_STR,
+      "Function '%s' needs a list of names.", func);
+  }
+  std::vector<std::string> order;
+  for (int i = 0; i < names->count; i++) { order.push_back(names->cell[i]->str); }
+  lfile_by_seek by_seek = { f };
+  std::sort(order.begin(), order.end(), by_seek);
+
+  std::map<std::string, lval*> read;
+  for (size_t i = 0; i < order.size(); i++) {
+    if (read.count(order[i])) { continue; }
+    lval* x = lfile_get(f, order[i].c_str(), copy);
+    if (x->type == LVAL_ERR) {
+      for (std::map<std::string, lval*>::iterator it = read.begin(); it != read.end(); ++it) {
+        lval_del(it->second);
+      }
+      lval_del(a);
+      return x;
+    }
+    read[order[i]] = x;
+  }
+  /* A name given twice is looked up again, so that file-get-copy returns
+     two copies of its object */
+  lval* x = lval_qexpr();
+  for (int i = 0; i < names->count; i++) {
+    lval*& y = read[names->cell[i]->str];
+    if (y) {
+      lval_add(x, y);
+      y = NULL;
+    } else {
+      lval_add(x, lfile_get(f, names->cell[i]->str, copy));
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+// Reads an object by path, e.g. (file-get f "dir/h1"), or a list of them
+// with (file-get f {"h1" "dir/h2"}). Lists are read in file order. The
+// objects are shared with the cache and must not be modified.
+lval* builtin_file_get(lenv* e, lval* a) {
+  return builtin_file_get_any(e, a, "file-get", false);
+}
+
+// Like file-get, but returns copies that the script is free to modify.
+lval* builtin_file_get_copy(lenv* e, lval* a) {
+  return builtin_file_get_any(e, a, "file-get-copy", true);
+}
+
+// Returns the paths of all the objects in a file: (file-keys f).
+lval* builtin_file_keys(lenv* e, lval* a) {
+  LASSERT_NUM("file-keys", a, 1);
+  LASSERT_HANDLE("file-keys", a, 0, lfile, f);
+  std::vector<std::string> names;
+  for (std::unordered_map<std::string, TKey*>::iterator it = f->keys.begin();
+       it != f->keys.end(); ++it) {
+    names.push_back(it->first);
+  }
+  std::sort(names.begin(), names.end());
+  lval* x = lval_qexpr();
+  for (size_t i = 0; i < names.size(); i++) { lval_add(x, lval_str(names[i].c_str())); }
+  lval_del(a);
+  return x;
+}
+
+// Returns {hits misses bytes-cached objects-cached} for a file's cache.
+lval* builtin_file_stats(lenv* e, lval* a) {
+  LASSERT_NUM("file-stats", a, 1);
+  LASSERT_HANDLE("file-stats", a, 0, lfile, f);
+  lval* x = lval_qexpr();
+  lval_add(x, lval_num(f->hits));
+  lval_add(x, lval_num(f->misses));
+  lval_add(x, lval_num(f->used));
+  lval_add(x, lval_num(f->cache.size()));
+  lval_del(a);
+  return x;
+}
+
+/* Merging of histograms. When all histograms have the same class and
+   binning, the result is a clone of the first and the bin storage of the
+   others (contents, sum of squared weights, and the entries per bin of
+   profiles) is added to it array by array. The cells are split into one
+   contiguous slice per thread, so threads never write the same memory
+   and each inner loop is a plain vectorisable sum. Anything else goes
+   through TH1::Merge, which can rebin. */
+struct lhist_storage {
+  void* data[4];
+  int atype[4];
+  int count;
+};
+
+/* TArrayD member of a profile, or NULL for other histograms. Offsets are
+   cached, as merge-files looks them up from several threads. */
+TArrayD* lhist_member(TH1* h, const char* name) {
+  typedef std::pair<TClass*, std::string> lhist_key;
+  static std::map<lhist_key, Long_t> cache;
+  Long_t offset;
+  {
+    std::lock_guard<std::mutex> lock(lglobal_mutex);
+    lhist_key key(h->IsA(), name);
+    std::map<lhist_key, Long_t>::iterator it = cache.find(key);
+    if (it == cache.end()) {
+      it = cache.insert(std::make_pair(key, h->IsA()->GetDataMemberOffset(name))).first;
+    }
+    offset = it->second;
+  }
+  return offset > 0 ? (TArrayD*)((char*)h + offset) : NULL;
+}
+
+/* The arrays of h that merging adds up, all of GetNcells() elements. A
+   histogram still buffering its entries has none: emptying the buffer may
+   rebin it and move the arrays, so TH1::Merge has to deal with it. */
+bool lhist_storage_of(lval* h, lhist_storage* s) {
+  s->count = 0;
+  if (((TH1*)h->obj)->GetBuffer()) { return false; }
+  lval* contents = larray_view_of(h, "contents", 0);
+  if (contents->type == LVAL_ERR) { lval_del(contents); return false; }
+  s->data[s->count] = contents->data;
+  s->atype[s->count++] = contents->atype;
+  lval_del(contents);
+
+  TH1* hist = (TH1*)h->obj;
+  if (hist->GetSumw2N()) {
+    s->data[s->count] = hist->GetSumw2()->GetArray();
+    s->atype[s->count++] = kDouble_t;
+  }
+  const char* members[] = { "fBinEntries", "fBinSumw2" };
+  for (int i = 0; i < 2; i++) {
+    TArrayD* a = lhist_member(hist, members[i]);
+    if (a && a->fN) {
+      s->data[s->count] = a->GetArray();
+      s->atype[s->count++] = kDouble_t;
+    }
+  }
+  return true;
+}
+
+bool laxis_same(TAxis* x, TAxis* y) {
+  /* Labelled bins are matched by label, which TH1::Merge takes care of */
+  if (x->GetLabels() || y->GetLabels()) { return false; }
+  if (x->GetNbins() != y->GetNbins() || x->GetXmin() != y->GetXmin()
+      || x->GetXmax() != y->GetXmax()) { return false; }
+  for (int i = 1; i <= x->GetNbins(); i++) {
+    if (x->GetBinLowEdge(i) != y->GetBinLowEdge(i)) { return false; }
+  }
+  return true;
+}
+
+/* Whether y can be added to x array by array */
+bool lhist_compatible(TH1* x, const lhist_storage& sx, TH1* y, const lhist_storage& sy) {
+  if (x->IsA() != y->IsA() || x->GetNcells() != y->GetNcells()
+      || sx.count != sy.count) { return false; }
+  for (int i = 0; i < sx.count; i++) {
+    if (sx.atype[i] != sy.atype[i]) { return false; }
+  }
+  return laxis_same(x->GetXaxis(), y->GetXaxis())
+    && laxis_same(x->GetYaxis(), y->GetYaxis())
+    && laxis_same(x->GetZaxis(), y->GetZaxis());
+}
+
+/* Add cells [first, last) of all the inputs to the result */
+void lhist_add_slice(lhist_storage* result, std::vector<lhist_storage>* inputs,
+                     long first, long last) {
+  for (int k = 0; k < result->count; k++) {
+    for (size_t i = 0; i < inputs->size(); i++) {
+#define ADD(T) larray_axpy((T*)result->data[k] + first, \
+                           (T*)(*inputs)[i].data[k] + first, last - first, 1.)
+      LARRAY_SWITCH(result->atype[k], ADD)
+#undef ADD
+    }
+  }
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-  return builtin_var(e, a, "=");
+/* Elements of a list or sequence of objects */
+lval* lval_list_objects(lenv* e, lval* l, std::vector<lval*>& items) {
+  if (l->type == LVAL_SEQ) {
+    lval* s = lval_copy(l);
+    for (; s->obj; lval_seq_next(s)) { items.push_back(lval_seq_current(s)); }
+    lval_del(s);
+    return NULL;
+  }
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_list_item(e, l, i);
+    items.push_back(x);
+    if (x->type == LVAL_ERR) { return lval_copy(x); }
+  }
+  return NULL;
 }
 
-int lval_eq(lval* x, lval* y) {
+// Merges a list of histograms into a new one: (merge {h1 h2 ...} [threads]).
+lval* builtin_merge(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'merge' passed %i arguments, expected 1 or 2.", a->count);
+  LASSERT_LIST("merge", a, 0);
+  if (a->count == 2) { LASSERT_TYPE("merge", a, 1, LVAL_NUM); }
+  int threads = a->count == 2 ? a->cell[1]->num : std::thread::hardware_concurrency();
+
+  std::vector<lval*> hs;
+  lval* err = lval_list_objects(e, a->cell[0], hs);
+  for (size_t i = 0; i < hs.size() && !err; i++) {
+    if (lval_deleted(hs[i])) {
+      err = lval_err("Function 'merge' passed an object that was deleted by ROOT.");
+    } else if (hs[i]->type != LVAL_TOBJ || !hs[i]->obj || !hs[i]->obj->InheritsFrom(TH1::Class())) {
+      err = lval_err("Function 'merge' can only merge histograms.");
+    }
+  }
+  if (!err && hs.empty()) { err = lval_err("Function 'merge' passed no histograms."); }
+  if (err) {
+    for (size_t i = 0; i < hs.size(); i++) { lval_del(hs[i]); }
+    lval_del(a);
+    return err;
+  }
 
-  /* Different Types are always unequal */
-  if (x->type != y->type) { return 0; }
+  TH1* first = (TH1*)hs[0]->obj;
+  TH1* result = (TH1*)first->Clone();
+  result->SetDirectory(NULL);
+  lval* x = lval_tobj_owned(result);
+
+  lhist_storage rs;
+  bool fast = lhist_storage_of(x, &rs);
+  std::vector<lhist_storage> inputs(hs.size() - 1);
+  for (size_t i = 1; i < hs.size() && fast; i++) {
+    fast = lhist_storage_of(hs[i], &inputs[i - 1])
+      && lhist_compatible(result, rs, (TH1*)hs[i]->obj, inputs[i - 1]);
+  }
 
-  /* Compare Based upon type */
-  switch (x->type) {
-    /* Compare Number Value */
-    case LVAL_NUM: return (x->num == y->num);
-    case LVAL_FLOAT: return (x->floating == y->floating);
+  if (fast) {
+    Double_t stats[TH1::kNstat] = { 0 }, more[TH1::kNstat] = { 0 };
+    result->GetStats(stats);
+    double entries = result->GetEntries();
+    for (size_t i = 1; i < hs.size(); i++) {
+      TH1* h = (TH1*)hs[i]->obj;
+      h->GetStats(more);
+      for (int k = 0; k < TH1::kNstat; k++) { stats[k] += more[k]; }
+      entries += h->GetEntries();
+    }
 
-    /* Compare String Values */
-    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+    /* Small merges are not worth a thread */
+    long cells = result->GetNcells();
+    long work = cells * (long)inputs.size();
+    if (threads > work / 65536 + 1) { threads = work / 65536 + 1; }
+    if (threads < 1) { threads = 1; }
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+      pool.push_back(std::thread(lhist_add_slice, &rs, &inputs,
+                                 cells * t / threads, cells * (t + 1) / threads));
+    }
+    lhist_add_slice(&rs, &inputs, 0, cells / threads);
+    for (size_t t = 0; t < pool.size(); t++) { pool[t].join(); }
 
-    /* If builtin compare, otherwise compare formals and body */
-    case LVAL_FUN:
-      if (x->builtin || y->builtin) {
-        return x->builtin == y->builtin;
-      } else {
-        return lval_eq(x->formals, y->formals) 
-          && lval_eq(x->body, y->body);
-      }
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    result->PutStats(stats);
+    result->SetEntries(entries);
+  } else {
+    TList others;
+    for (size_t i = 1; i < hs.size(); i++) { others.Add(hs[i]->obj); }
+    result->Merge(&others);
+  }
 
-    /* If list compare every individual element */
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      if (x->count != y->count) { return 0; }
-      for (int i = 0; i < x->count; i++) {
-        /* If any element not equal then whole list not equal */
-        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
-      }
-      /* Otherwise lists must be equal */
-      return 1;
-    break;
+  for (size_t i = 0; i < hs.size(); i++) { lval_del(hs[i]); }
+  lredraw_touch_value(x);
+  lval_del(a);
+  return x;
+}
+
+/* Add y to x if they have the same class and binning, see merge */
+bool lhist_add(TH1* x, TH1* y) {
+  lval* lx = lval_tobj(x);
+  lval* ly = lval_tobj(y);
+  lhist_storage sx, sy;
+  bool ok = lhist_storage_of(lx, &sx) && lhist_storage_of(ly, &sy)
+    && lhist_compatible(x, sx, y, sy);
+  lval_del(lx);
+  lval_del(ly);
+  if (!ok) { return false; }
+
+  Double_t stats[TH1::kNstat] = { 0 }, more[TH1::kNstat] = { 0 };
+  double entries = x->GetEntries() + y->GetEntries();
+  x->GetStats(stats);
+  y->GetStats(more);
+  for (int k = 0; k < TH1::kNstat; k++) { stats[k] += more[k]; }
+  std::vector<lhist_storage> inputs(1, sy);
+  lhist_add_slice(&sx, &inputs, 0, x->GetNcells());
+  x->PutStats(stats);
+  x->SetEntries(entries);
+  return true;
+}
+
+/* Directory at path in out, created if needed */
+TDirectory* lfile_mkdir(TDirectory* out, const std::string& path) {
+  TDirectory* dir = out;
+  size_t start = 0, slash;
+  while ((slash = path.find('/', start)) != std::string::npos) {
+    std::string name = path.substr(start, slash - start);
+    TDirectory* sub = dir->GetDirectory(name.c_str());
+    dir = sub ? sub : dir->mkdir(name.c_str());
+    start = slash + 1;
   }
-  return 0;
+  return dir;
 }
 
+/* Merged state of one key path across the input files */
+struct lmerge_group {
+  TObject* obj;      /* histogram sum, or first instance of other objects */
+  TTree* tree;       /* output tree, written into the output file */
+};
 
+/* A histogram read from the current input, to be added to its group */
+struct lmerge_item {
+  lmerge_group* group;
+  TH1* hist;
+  bool added;
+};
 
-lval* builtin_lambda(lenv* e, lval* a) {
-  /* Check Two arguments, each of which are Q-Expressions */
-  LASSERT_NUM("\\", a, 2);
-  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
-  
-  /* Check first Q-Expression contains only Symbols */
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-      "Cannot define non-symbol. Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+void lmerge_add_items(std::vector<lmerge_item>* items, std::atomic<size_t>* next) {
+  for (size_t i = (*next)++; i < items->size(); i = (*next)++) {
+    lmerge_item& it = (*items)[i];
+    it.added = lhist_add((TH1*)it.group->obj, it.hist);
   }
-  
-  /* Pop first two arguments and pass them to lval_lambda */
-  lval* formals = lval_pop(a, 0);
-  lval* body = lval_pop(a, 0);
-  lval_del(a);
-  
-  return lval_lambda(formals, body);
 }
 
-void lenv_add_builtin(lenv* e, const char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_fun(func);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
-}
+/* Seek order of keys, so that each batch is read sequentially */
+struct lkey_by_seek {
+  bool operator()(const std::pair<std::string, TKey*>& x,
+                  const std::pair<std::string, TKey*>& y) const {
+    return x.second->GetSeekKey() < y.second->GetSeekKey();
+  }
+};
 
-void lenv_add_global_object(lenv* e, const char* name, TObject *obj) {
-  lval* k = lval_sym(name);
-  lval* v = lval_tobj(obj);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
+/* Writes the merged object of path to out and frees it, see merge-files */
+void lmerge_write(TFile* out, const std::string& path, lmerge_group* g) {
+  std::string name = path.substr(path.rfind('/') == std::string::npos ? 0 : path.rfind('/') + 1);
+  if (g->tree) {
+    g->tree->GetDirectory()->cd();
+    g->tree->Write("", TObject::kOverwrite);
+    delete g->tree;
+  } else {
+    lfile_mkdir(out, path)->WriteTObject(g->obj, name.c_str());
+    delete g->obj;
+  }
+  out->cd();
 }
 
-lval* builtin_load(lenv* e, lval* a) {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
-  
-  /* Parse File given by string name */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-    
-    /* Read contents */
-    lval* expr = lval_read((mpc_ast_t *)r.output);
-    mpc_ast_delete((mpc_ast_t *)r.output);
-
-    /* Evaluate each Expression */
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      /* If Evaluation leads to error print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
-    }
-    
-    /* Delete expressions and arguments */
-    lval_del(expr);    
-    lval_del(a);
-    
-    /* Return empty list */
-    return lval_sexpr();
-    
-  } else {
-    /* Get Parse Error as String */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-    
-    /* Create new error message using it */
-    lval* err = lval_err("Could not load Library %s", err_msg);
-    free(err_msg);
+#define LMERGE_BYTES (256L << 20)
+
+// Merges the objects of many files into a new one, like hadd:
+// (merge-files out {files} [threads [max-bytes]])
+// Objects are grouped by path. Histograms are summed as the inputs are
+// read, at most max-bytes of them at a time and in parallel across paths,
+// trees are copied basket by basket and any other object is taken from the
+// first file that has it. A merged object is written out, and freed, as
+// soon as the last input having its path has been read. Returns the number
+// of objects written.
+lval* builtin_merge_files(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 2 && a->count <= 4,
+    "Function 'merge-files' passed %i arguments, expected 2 to 4.", a->count);
+  LASSERT_TYPE("merge-files", a, 0, LVAL_STR);
+  LASSERT_TYPE("merge-files", a, 1, LVAL_QEXPR);
+  for (int i = 2; i < a->count; i++) { LASSERT_TYPE("merge-files", a, i, LVAL_NUM); }
+  lval* inputs = a->cell[1];
+  for (int i = 0; i < inputs->count; i++) {
+    LASSERT(a, inputs->cell[i]->type == LVAL_STR,
+      "Function 'merge-files' needs a list of file names.");
+  }
+  int threads = a->count > 2 ? a->cell[2]->num : std::thread::hardware_concurrency();
+  long budget = a->count > 3 ? a->cell[3]->num : LMERGE_BYTES;
+  if (threads < 1) { threads = 1; }
+
+  /* Trees are cloned into, and written from, the output directories */
+  TDirectory::TContext ctx(gDirectory);
+
+  TFile* out = lfile_open_quiet(a->cell[0]->str, "RECREATE");
+  if (!out || out->IsZombie()) {
+    delete out;
+    lval* err = lval_err("Could not create file %s.", a->cell[0]->str);
     lval_del(a);
-    
-    /* Cleanup and return error */
     return err;
   }
-}
 
-lval* builtin_print(lenv* e, lval* a) {
+  /* Last input having each path, so that groups can be written early */
+  std::map<std::string, int> last;
+  lval* err = NULL;
+  for (int f = 0; f < inputs->count && !err; f++) {
+    TFile* in = lfile_open_quiet(inputs->cell[f]->str);
+    if (!in || in->IsZombie()) {
+      err = lval_err("Could not open file %s.", inputs->cell[f]->str);
+    } else {
+      std::unordered_map<std::string, TKey*> index;
+      lfile_index(index, in, "");
+      for (std::unordered_map<std::string, TKey*>::iterator i = index.begin(); i != index.end(); ++i) {
+        last[i->first] = f;
+      }
+    }
+    delete in;
+  }
 
-  /* Print each argument followed by a space */
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]); putchar(' ');
+  std::map<std::string, lmerge_group> groups;
+  long written = 0;
+  for (int f = 0; f < inputs->count && !err; f++) {
+    TFile* in = lfile_open_quiet(inputs->cell[f]->str);
+    if (!in || in->IsZombie()) {
+      delete in;
+      err = lval_err("Could not open file %s.", inputs->cell[f]->str);
+      break;
+    }
+    std::unordered_map<std::string, TKey*> index;
+    lfile_index(index, in, "");
+    std::vector<std::pair<std::string, TKey*> > keys(index.begin(), index.end());
+    std::sort(keys.begin(), keys.end(), lkey_by_seek());
+
+    size_t k = 0;
+    while (k < keys.size() && !err) {
+      /* Read a batch of histograms, copying trees and taking other
+         objects on the way */
+      std::vector<lmerge_item> items;
+      long bytes = 0;
+      for (; k < keys.size() && (items.empty() || bytes < budget); k++) {
+        const std::string& path = keys[k].first;
+        TKey* key = keys[k].second;
+        TClass* cls = TClass::GetClass(key->GetClassName());
+        if (!cls || cls->InheritsFrom(TDirectory::Class())) { continue; }
+        std::map<std::string, lmerge_group>::iterator g = groups.find(path);
+
+        if (cls->InheritsFrom(TTree::Class())) {
+          TTree* tree = (TTree*)in->Get(path.c_str());
+          if (!tree) { continue; }
+          if (g == groups.end()) {
+            lmerge_group group = { NULL, NULL };
+            lfile_mkdir(out, path)->cd();
+            group.tree = tree->CloneTree(-1, "fast");
+            groups[path] = group;
+          } else if (g->second.tree) {
+            g->second.tree->CopyEntries(tree, -1, "fast");
+          }
+          continue;
+        }
+
+        if (g != groups.end() && (!cls->InheritsFrom(TH1::Class()) || !g->second.obj
+                                  || !g->second.obj->InheritsFrom(TH1::Class()))) { continue; }
+        TObject* obj = key->ReadObj();
+        if (!obj) { continue; }
+        if (obj->InheritsFrom(TH1::Class())) { ((TH1*)obj)->SetDirectory(NULL); }
+        if (g == groups.end()) {
+          lmerge_group group = { obj, NULL };
+          groups[path] = group;
+          continue;
+        }
+        lmerge_item item = { &g->second, (TH1*)obj, false };
+        items.push_back(item);
+        bytes += key->GetObjlen();
+      }
+
+      /* Add the batch, each group being summed by a single thread */
+      std::atomic<size_t> next(0);
+      std::vector<std::thread> pool;
+      int n = threads < (int)items.size() ? threads : items.size();
+      for (int t = 1; t < n; t++) {
+        pool.push_back(std::thread(lmerge_add_items, &items, &next));
+      }
+      lmerge_add_items(&items, &next);
+      for (size_t t = 0; t < pool.size(); t++) { pool[t].join(); }
+
+      for (size_t i = 0; i < items.size(); i++) {
+        if (!items[i].added) {
+          TList other;
+          other.Add(items[i].hist);
+          ((TH1*)items[i].group->obj)->Merge(&other);
+        }
+        delete items[i].hist;
+      }
+    }
+    delete in;
+
+    /* Write the groups no later input adds to */
+    for (std::map<std::string, lmerge_group>::iterator g = groups.begin(); g != groups.end(); ) {
+      if (last[g->first] > f) { ++g; continue; }
+      lmerge_write(out, g->first, &g->second);
+      written++;
+      groups.erase(g++);
+    }
   }
 
-  /* Print a newline and delete arguments */
-  putchar('\n');
+  /* Left over by an error: trees belong to out, the rest is freed */
+  for (std::map<std::string, lmerge_group>::iterator g = groups.begin(); g != groups.end(); ++g) {
+    delete g->second.obj;
+  }
+  delete out;
   lval_del(a);
-
-  return lval_sexpr();
+  return err ? err : lval_num(written);
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
+/* Canvas redraws. Instead of updating every canvas after every line, the
+   objects the script used since the last redraw are recorded, the pads
+   drawing them are marked as modified, and only canvases with modified
+   pads are updated. Redraws are also limited to a few per second: an
+   evaluation coming too soon after the previous redraw schedules one
+   for later, which any further evaluation in the meantime joins. */
+struct lredraw {
+  std::set<TObject*> touched;   /* only compared, never dereferenced */
+  double last;
+  double interval;
+  bool pending;
+};
 
-  /* Construct Error from first argument */
-  lval* err = lval_err(a->cell[0]->str);
+lredraw lredraw_state = { std::set<TObject*>(), 0., 1. / 30, false };
 
-  /* Delete arguments and return */
-  lval_del(a);
-  return err;
+void lredraw_touch(TObject* obj) {
+  if (!obj) { return; }
+  std::lock_guard<std::mutex> lock(lglobal_mutex);
+  lredraw_state.touched.insert(obj);
 }
 
-lval* builtin_exit(lenv* e, lval* a) {
-  LASSERT_NUM("exit", a, 1);
-  LASSERT_TYPE("exit", a, 0, LVAL_NUM);
+/* Records the objects in v, a value or a list of them, together with the
+   objects they live in */
+void lredraw_touch_value(lval* v) {
+  if (v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) { lredraw_touch_value(v->cell[i]); }
+  } else if (v->type == LVAL_TOBJ || v->type == LVAL_ARRAY) {
+    if (v->type == LVAL_TOBJ) { lredraw_touch(v->obj); }
+    if (v->ref && v->ref->obj != v->obj) { lredraw_touch(v->ref->obj); }
+  }
+}
 
-  exit(a->cell[0]->num);
+/* Whether the primitive p was touched, directly or through one of its
+   parts that a script can reach without its owner: the axes and fitted
+   functions of a histogram */
+bool lredraw_touched(TObject* p) {
+  std::set<TObject*>& touched = lredraw_state.touched;
+  if (touched.empty()) { return false; }
+  if (touched.count(p)) { return true; }
+  if (!p->InheritsFrom(TH1::Class())) { return false; }
+  TH1* h = (TH1*)p;
+  if (touched.count(h->GetXaxis()) || touched.count(h->GetYaxis())
+      || touched.count(h->GetZaxis())) { return true; }
+  TIter next(h->GetListOfFunctions());
+  while (TObject* f = next()) {
+    if (touched.count(f)) { return true; }
+  }
+  return false;
+}
 
-  /* Delete arguments and return */
-  lval_del(a);
-  return 0;
+/* Mark the pads (pad itself or its subpads) drawing touched objects */
+bool lredraw_mark(TVirtualPad* pad) {
+  bool modified = pad->IsModified();
+  TIter next(pad->GetListOfPrimitives());
+  while (TObject* p = next()) {
+    if (p->InheritsFrom(TVirtualPad::Class())) {
+      modified |= lredraw_mark((TVirtualPad*)p);
+    } else if (!pad->IsModified() && lredraw_touched(p)) {
+      pad->Modified();
+      modified = true;
+    }
+  }
+  return modified;
 }
 
-// Creates a new TObject
-lval *builtin_new(lenv *e, lval* a) {
-  LASSERT(a, a->count >= 1,
-    "Function 'new' needs at least 1 argument: <class name>.");
-  LASSERT_TYPE("new", a, 0, LVAL_STR);
-  // Create an object of the given class
-  const char *className = a->cell[0]->str;
-  std::string args = lval_to_cpp_arg(a, 1);
-  int error = 0;
+/* Update the canvases showing anything that changed */
+void lredraw_flush() {
+  TIter next(gROOT->GetListOfCanvases());
+  while (TVirtualPad* canvas = (TVirtualPad*)next()) {
+    if (lredraw_mark(canvas) || lredraw_state.touched.count(canvas)) {
+      canvas->Update();
+    }
+  }
+  lredraw_state.touched.clear();
+  lredraw_state.last = lclock();
+  lredraw_state.pending = false;
+}
 
-  std::string ctorLine = std::string("new ") + className + "(" + args + ");";
-  TObject *obj = (TObject *)gInterpreter->Calc(ctorLine.c_str());
+class TRedrawTimer : public TTimer {
+public:
+  Bool_t Notify() { lredraw_flush(); return kTRUE; }
+};
+
+/* Called after each evaluation */
+void lredraw_request() {
+  if (lredraw_state.pending) { return; }
+  double wait = lredraw_state.last + lredraw_state.interval - lclock();
+  if (wait <= 0 || gROOT->IsBatch()) {
+    lredraw_flush();
+    return;
+  }
+  static TRedrawTimer* timer = new TRedrawTimer();
+  timer->Start((Long_t)(wait * 1000) + 1, kTRUE);
+  lredraw_state.pending = true;
+}
 
-  obj->IsA()->Print();
+// Updates the canvases that changed right away: (redraw).
+lval* builtin_redraw(lenv* e, lval* a) {
+  LASSERT_NUM("redraw", a, 0);
   lval_del(a);
-  if (error)
-    return lval_err("Constructor not found for %s",  className);
-  return lval_tobj(obj);
+  lredraw_flush();
+  return lval_sexpr();
 }
 
-// Invokes a method
-lval *builtin_invoke(lenv *e, lval *a) {
-  LASSERT_NUM("invoke", a, 2);
-  LASSERT_TYPE("invoke", a, 0, LVAL_TMETHOD);
-  LASSERT_TYPE("invoke", a, 1, LVAL_TOBJ);
-  TMethodCall *m = a->cell[0]->method;
-  const char *args = a->cell[0]->methodArgs;
-  printf("Return type is %i\n", m->ReturnType());
-  printf("Executing method with arguments %s(%s)\n", m->GetMethodName(), args);
-  m->Execute(a->cell[1]->obj, args);
-  return lval_qexpr();
+// Sets the maximum number of canvas redraws per second: (redraw-rate 30).
+lval* builtin_redraw_rate(lenv* e, lval* a) {
+  LASSERT_NUM("redraw-rate", a, 1);
+  LASSERT_NUMERIC("redraw-rate", a, 0);
+  double rate = lval_to_double(a->cell[0]);
+  LASSERT(a, rate > 0, "Function 'redraw-rate' needs a positive rate.");
+  lredraw_state.interval = 1. / rate;
+  lval_del(a);
+  return lval_sexpr();
 }
 
 void lenv_add_builtins(lenv* e) {  
@@ -1267,6 +5759,11 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "foldl", builtin_foldl);
+  lenv_add_builtin(e, "seq", builtin_seq);
   /* Variable Functions */
   lenv_add_builtin(e, "\\",  builtin_lambda);
   lenv_add_builtin(e, "def", builtin_def);
@@ -1286,6 +5783,15 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "<",  builtin_lt);
   lenv_add_builtin(e, ">=", builtin_ge);
   lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_special(e, "and", builtin_and);
+  lenv_add_special(e, "or",  builtin_or);
+  lenv_add_builtin(e, "select", builtin_select);
+  lenv_add_builtin(e, "case",   builtin_case);
+  lenv_add_thunk(e, "case-stats", builtin_case_stats);
+
+  /* Sequencing and Scopes */
+  lenv_add_special(e, "do",  builtin_do);
+  lenv_add_builtin(e, "let", builtin_let);
 
   /*Helpers*/
   lenv_add_builtin(e, "load", builtin_load);
@@ -1298,15 +5804,62 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "member", builtin_member);
   lenv_add_builtin(e, ".", builtin_member);
   lenv_add_builtin(e, "invoke", builtin_invoke);
-  
-  /*A few TObjects */
-  lenv_add_global_object(e, "gSystem", gSystem);
-  lenv_add_global_object(e, "gInterpreter", gInterpreter);
-  lenv_add_global_object(e, "gROOT", gROOT);
-  lenv_add_global_object(e, "gFile", gFile);
-  lenv_add_global_object(e, "gPad", gPad);
-  lenv_add_global_object(e, "gDirectory", gDirectory);
-  lenv_add_global_object(e, "gRandom", gRandom);
+  lenv_add_builtin(e, "field", builtin_field);
+  lenv_add_thunk(e, "live-objects", builtin_live_objects);
+  lenv_add_builtin(e, "pool", builtin_pool);
+  lenv_add_thunk(e, "pool-stats", builtin_pool_stats);
+
+  /* Numeric arrays */
+  lenv_add_builtin(e, "array", builtin_array);
+  lenv_add_builtin(e, "view", builtin_view);
+  lenv_add_builtin(e, "view-const", builtin_view_const);
+  lenv_add_builtin(e, "aget", builtin_aget);
+  lenv_add_builtin(e, "aset", builtin_aset);
+  lenv_add_builtin(e, "asum", builtin_asum);
+  lenv_add_builtin(e, "amin", builtin_amin);
+  lenv_add_builtin(e, "amax", builtin_amax);
+  lenv_add_builtin(e, "ascale", builtin_ascale);
+  lenv_add_builtin(e, "afill", builtin_afill);
+  lenv_add_builtin(e, "aadd", builtin_aadd);
+  lenv_add_builtin(e, "alist", builtin_alist);
+
+  /* Trees */
+  lenv_add_builtin(e, "tree-reader", builtin_tree_reader);
+  lenv_add_builtin(e, "tree-read", builtin_tree_read);
+  lenv_add_builtin(e, "read-tree", builtin_read_tree);
+  lenv_add_builtin(e, "tree-prefetch", builtin_tree_prefetch);
+  lenv_add_builtin(e, "tree-stats", builtin_tree_stats);
+  lenv_add_builtin(e, "tree-writer", builtin_tree_writer);
+  lenv_add_builtin(e, "tree-write", builtin_tree_write);
+  lenv_add_builtin(e, "tree-close", builtin_tree_close);
+  lenv_add_builtin(e, "write-tree", builtin_write_tree);
+  lenv_add_builtin(e, "tree-fold", builtin_tree_fold);
+
+  /* Dataflow queries */
+  lenv_add_builtin(e, "dataframe", builtin_dataframe);
+  lenv_add_builtin(e, "df-define", builtin_df_define);
+  lenv_add_builtin(e, "df-filter", builtin_df_filter);
+  lenv_add_builtin(e, "df-histo1d", builtin_df_histo1d);
+  lenv_add_builtin(e, "df-count", builtin_df_count);
+  lenv_add_builtin(e, "df-get", builtin_df_get);
+
+  /* Files */
+  lenv_add_builtin(e, "open-file", builtin_open_file);
+  lenv_add_builtin(e, "file-get", builtin_file_get);
+  lenv_add_builtin(e, "file-get-copy", builtin_file_get_copy);
+  lenv_add_builtin(e, "file-keys", builtin_file_keys);
+  lenv_add_builtin(e, "file-stats", builtin_file_stats);
+
+  /* Merging */
+  lenv_add_builtin(e, "merge", builtin_merge);
+  lenv_add_builtin(e, "merge-files", builtin_merge_files);
+
+  /* Graphics */
+  lenv_add_thunk(e, "redraw", builtin_redraw);
+  lenv_add_builtin(e, "redraw-rate", builtin_redraw_rate);
+
+  /* Startup */
+  lenv_add_thunk(e, "startup-time", builtin_startup_time);
 }
 
 //----- Interrupt signal handler -----------------------------------------------
@@ -1402,11 +5955,7 @@ ROOTureApp::Run(Bool_t retrn) {
       lval_del(x);
     }
   }
-  TIter next(gROOT->GetListOfCanvases());
-  TVirtualPad* canvas;
-  while ((canvas = (TVirtualPad*)next())) {
-    canvas->Update();
-  }
+  lredraw_request();
 
   fInputHandler->Activate();
   Getlinem(kInit, "ROOTure> ");
@@ -1444,27 +5993,21 @@ ROOTureApp::HandleTermInput()
   TTHREAD_TLS(Bool_t) added;
   added = kFALSE; // reset on each call.
 
-  /* Attempt to parse the user input */
-  mpc_result_t r;
-  if (mpc_parse("<stdin>", input, Lispy, &r)) {
-    /* On success print and delete the AST */
-    mpc_ast_print((mpc_ast_t*)r.output);
-    lval* x = lval_eval(fGlobalContext, lval_read((mpc_ast_t *)r.output));
+  /* Attempt to read the user input */
+  lval* expr = lread("<stdin>", input, strlen(input));
+  if (expr->type != LVAL_ERR) {
+    lval* x = lval_eval(fGlobalContext, expr);
     lval_println(x);
     lval_del(x);
   } else {
     /* Otherwise print and delete the Error */
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
+    fputs(expr->err, stdout);
+    lval_del(expr);
   }
   free((void *)input);
   if (!sline.IsNull())
     LineProcessed(sline);
-  TIter next(gROOT->GetListOfCanvases());
-  TVirtualPad* canvas;
-  while ((canvas = (TVirtualPad*)next())) {
-    canvas->Update();
-  }
+  lredraw_request();
 
   fInputHandler->Activate();
 
@@ -1489,7 +6032,69 @@ ROOTureApp::HandleException(Int_t sig)
 
 ClassImp(ROOTureApp)
 
-int main(int argc, char** argv) {
+/* Evaluates the standard library in input and writes the definitions it
+   made as a C header embedding their image, see lstdlib_image_install.
+   Run at build time through rooture --write-image <output> <input>. */
+int lstdlib_image_write(const char* output, const char* input) {
+  lenv* e = lenv_new();
+  lenv_add_builtins(e);
+  std::vector<lbuiltin> builtins;
+  for (int i = 0; i < e->count; i++) { builtins.push_back(e->vals[i]->builtin); }
+
+  lsource source;
+  if (!lsource_open(source, input)) {
+    fprintf(stderr, "Cannot read %s\n", input);
+    return 1;
+  }
+  lval* x = lval_load(e, input, NULL);
+  if (x->type == LVAL_ERR) { lval_println(x); }
+  int failed = x->type == LVAL_ERR || lload_errors;
+  lval_del(x);
+  if (failed) { return 1; }
+
+  /* Keep what the library defined or redefined, but not the symbols
+     which were bound to their own name as they were looked up */
+  lval* defs = lval_qexpr();
+  for (int i = 0; i < e->count; i++) {
+    lval* v = e->vals[i];
+    if (i < (int)builtins.size() && v->type == LVAL_FUN &&
+        v->builtin == builtins[i]) { continue; }
+    if (v->type == LVAL_STR && strcmp(v->str, e->syms[i]) == 0) { continue; }
+    lval* def = lval_qexpr();
+    lval_add(def, lval_sym(e->syms[i]));
+    lval_add(def, lval_copy(v));
+    lval_add(defs, def);
+  }
+  std::string image;
+  bool ok = limage_write(image, defs);
+  lval_del(defs);
+  lenv_del(e);
+  if (!ok) {
+    fprintf(stderr, "%s defines values which cannot be stored in an image\n",
+            input);
+    return 1;
+  }
+
+  FILE* f = fopen(output, "w");
+  if (!f) {
+    fprintf(stderr, "Cannot write %s\n", output);
+    return 1;
+  }
+  fprintf(f, "/* Generated from stdlib.rut by rooture --write-image. "
+             "Do not edit. */\n\n");
+  fprintf(f, "static const unsigned long long lstdlib_image_hash = 0x%llxULL;\n\n",
+          lhash(source.data, source.size));
+  fprintf(f, "static const unsigned char lstdlib_image[] = {");
+  for (size_t i = 0; i < image.size(); i++) {
+    fprintf(f, "%s0x%02x,", i % 12 ? " " : "\n  ", (unsigned char)image[i]);
+  }
+  fprintf(f, "\n};\n");
+  return fclose(f) == 0 ? 0 : 1;
+}
+
+/* The mpc grammar of the language, which lread implements by hand. It is
+   only built to compare the two, see lreader_bench. */
+void lgrammar_init(int flags) {
   /* Create Some Parsers */
   Floating  = mpc_new("floating");
   Number    = mpc_new("number");
@@ -1502,7 +6107,7 @@ int main(int argc, char** argv) {
   Lispy     = mpc_new("lispy");
 
   /* Define them with the following Language */
-  mpca_lang(MPCA_LANG_DEFAULT,
+  mpca_lang(flags,
     "                                                         \
       floating : /-?[0-9]+[.][0-9]*/                          \
                | /-?[.][0-9]+/ ;                              \
@@ -1517,17 +6122,167 @@ int main(int argc, char** argv) {
       lispy    : /^/ <expr>* /$/ ;                            \
     ",
   Floating, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+}
+
+void lgrammar_cleanup() {
+  mpc_cleanup(9,
+    Number, Floating, Symbol, String, Comment,
+    Sexpr,  Qexpr,  Expr,   Lispy);
+}
+
+/* Reads source with the mpc grammar built with flags, or returns NULL */
+lval* lgrammar_read(const std::string& source, int flags, double& seconds) {
+  lgrammar_init(flags);
+  double start = lclock();
+  mpc_result_t r;
+  lval* x = NULL;
+  if (mpc_parse("<bench>", source.c_str(), Lispy, &r)) {
+    x = lval_read((mpc_ast_t*)r.output);
+    mpc_ast_delete((mpc_ast_t*)r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  seconds = lclock() - start;
+  lgrammar_cleanup();
+  return x;
+}
+
+/* Times a grammar where every alternative of s parses the same a before
+   failing on the next character, so that without memoisation reading
+   depth nested a takes 3^depth steps */
+double lgrammar_ambiguous_bench(int depth, int flags) {
+  mpc_parser_t* S = mpc_new("s");
+  mpc_parser_t* A = mpc_new("a");
+  mpca_lang(flags,
+    " s : <a> 'x' | <a> 'y' | <a> 'z' ; "
+    " a : '(' <s> ')' | 'n' ; ",
+    S, A, NULL);
+  std::string source = std::string(depth, '(') + "n";
+  for (int i = 0; i < depth; i++) { source += "z)"; }
+  source += "z";
+
+  double start = lclock();
+  mpc_result_t r;
+  if (mpc_parse("<bench>", source.c_str(), S, &r)) {
+    mpc_ast_delete((mpc_ast_t*)r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  double seconds = lclock() - start;
+  mpc_cleanup(2, S, A);
+  return seconds;
+}
+
+/* Generates about megabytes of source mixing all the syntax and measures
+   the throughput of lread and of the mpc grammar, with and without
+   packrat memoisation, on it. All must read the same values. Run through
+   rooture --bench-reader [megabytes]. */
+int lreader_bench(double megabytes) {
+  std::string source;
+  unsigned long seed = 12345;
+  char buf[256];
+  while (source.size() < megabytes * 1048576) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    unsigned long x = seed >> 33;
+    snprintf(buf, sizeof(buf),
+      "; entry %lu\n"
+      "(def {h%lu} (new TH1F \"h%lu\" \"p_{T} \\\"%lu\\\"\" %lu -%lu.5 %.3f))\n"
+      "(fun {f%lu x & xs} {if (> x %lu) {+ x -%lu (* %lu. .%lu)} {list x xs}})\n",
+      x, x % 1000, x % 1000, x, x % 200 + 1, x % 7, x / 1e6,
+      x % 977, x % 13, x % 17, x % 19, x % 23);
+    source += buf;
+  }
+  double mb = source.size() / 1048576.;
+
+  double start = lclock();
+  lval* x = lread("<bench>", source.data(), source.size());
+  double reader = lclock() - start;
+  double grammar, packrat;
+  lval* y = lgrammar_read(source, MPCA_LANG_ARENA, grammar);
+  lval* z = lgrammar_read(source, MPCA_LANG_PACKRAT | MPCA_LANG_ARENA, packrat);
+
+  printf("%.2f MB of ROOTure\n", mb);
+  printf("  reader:      %8.3f s %8.2f MB/s\n", reader, mb / reader);
+  printf("  mpc:         %8.3f s %8.2f MB/s\n", grammar, mb / grammar);
+  printf("  mpc packrat: %8.3f s %8.2f MB/s\n", packrat, mb / packrat);
+  int same = y && z && lval_eq(x, y) && lval_eq(x, z);
+  if (!same) { puts("results differ"); }
+  lval_del(x);
+  if (y) { lval_del(y); }
+  if (z) { lval_del(z); }
+
+  for (int depth = 6; depth <= 12; depth += 3) {
+    printf("ambiguous grammar, depth %i\n", depth);
+    printf("  mpc:         %8.3f s\n",
+      lgrammar_ambiguous_bench(depth, MPCA_LANG_ARENA));
+    printf("  mpc packrat: %8.3f s\n",
+      lgrammar_ambiguous_bench(depth, MPCA_LANG_PACKRAT | MPCA_LANG_ARENA));
+  }
+  return same ? 0 : 1;
+}
 
+int main(int argc, char** argv) {
+  lstartup_times.start = lclock();
+
+  if (argc >= 2 && strcmp(argv[1], "--bench-reader") == 0) {
+    return lreader_bench(argc >= 3 ? atof(argv[2]) : 8);
+  }
+
+  /* Build step embedding the standard library, see lstdlib_image_write */
+  if (argc == 4 && strcmp(argv[1], "--write-image") == 0) {
+    return lstdlib_image_write(argv[2], argv[3]);
+  }
+
+  /* In batch mode (-b or --batch) the scripts given, or stdin if there
+     are none, are evaluated without a terminal, history, graphics or
+     event loop, and the exit status tells whether anything failed. */
+  bool batch = false;
+  std::vector<const char*> scripts;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else {
+      scripts.push_back(argv[i]);
+    }
+  }
+  if (batch) {
+    lroot_args.batch = true;
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+    lstartup_times.ready = lclock();
+    int status = 0;
+    for (size_t i = 0; i < scripts.size(); i++) {
+      lval* x = lval_load(e, scripts[i], NULL);
+      if (x->type == LVAL_ERR) { lval_println(x); status = 1; }
+      lval_del(x);
+    }
+    if (scripts.empty()) {
+      lval* x = lval_load(e, "<stdin>", stdin);
+      if (x->type == LVAL_ERR) { lval_println(x); status = 1; }
+      lval_del(x);
+    }
+    if (lload_errors) { status = 1; }
+    lenv_del(e);
+    return status;
+  }
   
   /* Print Version and Exit Information */
-  puts("ROOTure 0.1.0");
+  puts("ROOTure " ROOTURE_VERSION);
   puts("Press Ctrl+c to Exit\n");
 
   /* The environment*/
   lenv* e = lenv_new();
+  lroot_setup setup = { false, &argc, argv, e };
+  lroot_args = setup;
   lenv_add_builtins(e);
 
-  TApplication *app = new ROOTureApp(&argc, argv, e);
+  /* The interactive prompt and its event loop need the application, and
+     so ROOT, right away */
+  lroot_init();
+  TApplication *app = gApplication;
+  lstartup_times.ready = lclock();
   app->Run();
 
   /* In a never ending loop */
@@ -1539,27 +6294,20 @@ int main(int argc, char** argv) {
     /* Add input to history */
     add_history(input);
 
-    /* Attempt to parse the user input */
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      /* On success print and delete the AST */
-      mpc_ast_print((mpc_ast_t*)r.output);
-      lval* x = lval_eval(e, lval_read((mpc_ast_t *)r.output));
+    /* Attempt to read the user input */
+    lval* expr = lread("<stdin>", input, strlen(input));
+    if (expr->type != LVAL_ERR) {
+      lval* x = lval_eval(e, expr);
       lval_println(x);
       lval_del(x);
     } else {
       /* Otherwise print and delete the Error */
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+      fputs(expr->err, stdout);
+      lval_del(expr);
     }
     free(input);
   }
   lenv_del(e);
 
-  /* Undefine and delete our parsers */
-  mpc_cleanup(8, 
-    Number, Floating, Symbol, String, Comment, 
-    Sexpr,  Qexpr,  Expr,   Lispy);
-
   return 0;
 }